@@ -1,3 +1,4 @@
+#define PERL_NO_GET_CONTEXT
 #include "EXTERN.h"
 #include "perl.h"
 #include "XSUB.h"
@@ -6,81 +7,734 @@
 
 #include "vparse.h"
 
-// hv_store to array, create if not exists - from XML::Fast 0.11
-#define hv_store_aa( hv, kv, kl, sv ) \
-        STMT_START { \
-                SV **exists; \
-                if( ( exists = hv_fetch(hv, kv, kl, 0) ) && SvROK(*exists) && (SvTYPE( SvRV(*exists) ) == SVt_PVAV) ) { \
-                        AV *av = (AV *) SvRV( *exists ); \
-                        av_push( av, sv ); \
-                } \
-                else { \
-                        AV *av   = newAV(); \
-                        av_push( av, sv ); \
-                        (void) hv_store( hv, kv, kl, newRV_noinc( (SV *) av ), 0 ); \
-                } \
-        } STMT_END
+/* the keys every card and entry has, hashed once at BOOT time */
+enum {
+    KEY_GROUP, KEY_NAME, KEY_LINE, KEY_VALUE, KEY_VALUES, KEY_PARAMS,
+    KEY_TYPE, KEY_PROPERTIES, KEY_OBJECTS, KEY_FINGERPRINT
+};
+
+static struct {
+    const char *name;
+    I32 len;
+    U32 hash;
+} _keys[] = {
+    { "group", 5, 0 }, { "name", 4, 0 }, { "line", 4, 0 }, { "value", 5, 0 },
+    { "values", 6, 0 }, { "params", 6, 0 }, { "type", 4, 0 },
+    { "properties", 10, 0 }, { "objects", 7, 0 }, { "fingerprint", 11, 0 }
+};
+
+#define hv_store_key(hv, key, sv) hv_store((hv), _keys[key].name, _keys[key].len, (sv), _keys[key].hash)
+#define hv_fetch_key(hv, key) ((SV **) hv_common_key_len((hv), _keys[key].name, _keys[key].len, HV_FETCH_JUST_SV, NULL, _keys[key].hash))
+
+static void _keys_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(_keys) / sizeof(_keys[0]); i++)
+        PERL_HASH(_keys[i].hash, _keys[i].name, _keys[i].len);
+}
 
 #define str_u(val) (!val ? newSV(0) : is_utf8 ? newSVpvn_utf8((val), strlen(val), 1) : newSVpvn((val), strlen(val)))
 
 
-static HV *_card2perl(struct vparse_card *card, int is_utf8, int barekeys)
+/* BORROWED VALUES
+ *
+ * A big value which is in the source verbatim can point straight into
+ * it rather than being copied.  The scalar is read only and holds a
+ * reference to the source, which is our own copy-on-write copy of the
+ * caller's so that changing theirs can't move the buffer */
+
+#define BORROW_MIN 256
+
+/* sv_setsv only shares buffers copy-on-write in the core, as XS might
+ * write to them, so the source copy asks for it */
+#ifndef SV_COW_OTHER_PVS
+#define SV_COW_OTHER_PVS 0
+#endif
+
+#ifdef USE_ITHREADS
+/* a new thread copies the pointer into our source, but gets its own
+ * copy of the source, so point at the same place in that.  mg_ptr is
+ * the old scalar, which the clone maps to the new one */
+static int _borrow_dup(pTHX_ MAGIC *mg, CLONE_PARAMS *param)
+{
+    SV *old = (SV *) mg->mg_ptr;
+    SV *sv = (SV *) ptr_table_fetch(PL_ptr_table, old);
+    MAGIC *oldmg = mg_findext(old, PERL_MAGIC_ext, mg->mg_virtual);
+
+    PERL_UNUSED_ARG(param);
+    SvPV_set(sv, SvPVX(mg->mg_obj) + (SvPVX(old) - SvPVX(oldmg->mg_obj)));
+    mg->mg_ptr = (char *) sv;
+    return 0;
+}
+#else
+#  define _borrow_dup 0
+#endif
+
+static MGVTBL _borrow_vtbl = { 0, 0, 0, 0, 0, 0, _borrow_dup, 0 };
+
+static SV *_borrow(pTHX_ SV *source, int pos, STRLEN len, int is_utf8)
+{
+    SV *sv = newSV_type(SVt_PVMG);
+    MAGIC *mg;
+
+    SvPV_set(sv, SvPVX(source) + pos);
+    SvCUR_set(sv, len);
+    SvLEN_set(sv, 0);
+    SvPOK_on(sv);
+    if (is_utf8)
+        SvUTF8_on(sv);
+    mg = sv_magicext(sv, source, PERL_MAGIC_ext, &_borrow_vtbl, (char *) sv, 0);
+#ifdef USE_ITHREADS
+    mg->mg_flags |= MGf_DUP;
+#endif
+    SvREADONLY_on(sv);
+
+    return sv;
+}
+
+static SV *_value2sv(pTHX_ struct vparse_entry *entry, int is_utf8, SV *source)
+{
+    if (source && entry->rawpos) {
+        STRLEN len = strlen(entry->v.value);
+        if (len >= BORROW_MIN)
+            return _borrow(aTHX_ source, entry->rawpos, len, is_utf8);
+    }
+    return str_u(entry->v.value);
+}
+
+/* SHARED STRINGS
+ *
+ * Parameter values, names and card types which turn up in nearly every
+ * card, as one read only scalar each which every place they occur can
+ * hold a reference to.  Built at BOOT time and for each new thread, one
+ * table for byte strings and one for character strings */
+
+static const char *const _shared_list[] = {
+    "vcard",
+    "HOME", "WORK", "CELL", "VOICE", "INTERNET", "PREF", "FAX", "MSG",
+    "PAGER", "TEXT", "VIDEO", "CAR", "ISDN", "BBS", "MODEM", "PCS", "X400",
+    "DOM", "INTL", "POSTAL", "PARCEL", "OTHER", "MAIN", "IPHONE",
+    "home", "work", "cell", "voice", "internet", "pref", "fax", "msg",
+    "pager", "text", "video", "other", "main", "1", "2", "3",
+    "b", "B", "BASE64", "base64", "JPEG", "jpeg", "PNG", "png", "GIF",
+    "uri", "URI", "UTF-8", "utf-8", "QUOTED-PRINTABLE",
+    "begin", "version", "fn", "n", "tel", "email", "adr", "org", "title",
+    "note", "photo", "url", "uid", "rev", "bday", "label", "nickname",
+    "categories", "prodid", "impp", "x-abuid", "x-ablabel",
+    NULL
+};
+
+#define str_s(val) (shared && val ? _shared_sv(aTHX_ shared, (val), is_utf8) : str_u(val))
+
+static void _shared_init(pTHX_ HV **strings)
+{
+    int i, utf8;
+
+    for (utf8 = 0; utf8 < 2; utf8++) {
+        strings[utf8] = newHV();
+        for (i = 0; _shared_list[i]; i++) {
+            I32 len = strlen(_shared_list[i]);
+            /* perl keeps ASCII keys as bytes, so only those can share one */
+            SV *sv = utf8 ? newSVpvn_utf8(_shared_list[i], len, 1)
+                          : newSVpvn_share(_shared_list[i], len, 0);
+            SvREADONLY_on(sv);
+            hv_store(strings[utf8], _shared_list[i], len, sv, 0);
+        }
+    }
+}
+
+static SV *_shared_sv(pTHX_ HV *shared, const char *val, int is_utf8)
+{
+    SV **svp = hv_fetch(shared, val, strlen(val), 0);
+
+    if (svp)
+        return SvREFCNT_inc_simple_NN(*svp);
+
+    return str_u(val);
+}
+
+/* valueless parameters are types */
+#define PARAM_KEY(p) ((p)->value ? (p)->name : "type")
+#define PARAM_VALUE(p) ((p)->value ? (p)->value : (p)->name)
+
+/* grouping by scanning is quadratic, so only for the usual handful */
+#define PARAMS_SCAN 8
+
+static HV *_params2perl(pTHX_ struct vparse_param *params, int is_utf8, HV *shared)
+{
+    struct vparse_param *param, *p;
+    HV *prop = newHV();
+    int count = 0;
+
+    for (param = params; param && count <= PARAMS_SCAN; param = param->next)
+        count++;
+
+    if (count > PARAMS_SCAN) {
+        /* append through the hash as we go */
+        for (param = params; param; param = param->next) {
+            const char *key = PARAM_KEY(param);
+            STRLEN len = strlen(key);
+            SV **svp = hv_fetch(prop, key, len, 0);
+            AV *av;
+            if (svp) {
+                av = (AV *) SvRV(*svp);
+            }
+            else {
+                av = newAV();
+                hv_store(prop, key, len, newRV_noinc( (SV *) av), 0);
+            }
+            av_push(av, str_s(PARAM_VALUE(param)));
+        }
+        return prop;
+    }
+
+    for (param = params; param; param = param->next) {
+        const char *key = PARAM_KEY(param);
+        SSize_t n = 0;
+        AV *av;
+
+        /* each name once, at its first parameter */
+        for (p = params; p != param; p = p->next)
+            if (!strcmp(PARAM_KEY(p), key)) break;
+        if (p != param) continue;
+
+        for (p = param; p; p = p->next)
+            if (!strcmp(PARAM_KEY(p), key)) n++;
+        av = newAV();
+        av_extend(av, n - 1);
+        for (p = param; p; p = p->next)
+            if (!strcmp(PARAM_KEY(p), key)) av_push(av, str_s(PARAM_VALUE(p)));
+
+        hv_store(prop, key, strlen(key), newRV_noinc( (SV *) av), 0);
+    }
+
+    return prop;
+}
+
+/* if state is passed, entries get their source line number, if source
+ * is, big values borrow from it, and if shared is, common strings come
+ * from that table */
+static HV *_entry2perl(pTHX_ struct vparse_entry *entry, int is_utf8, struct vparse_state *state,
+                       SV *source, HV *shared)
+{
+    HV *item = newHV();
+
+    if (entry->group)
+        hv_store_key(item, KEY_GROUP, str_u(entry->group));
+
+    hv_store_key(item, KEY_NAME, str_s(entry->name));
+
+    if (state) {
+        int line, col;
+        vparse_linepos(state, entry->srcpos, &line, &col);
+        hv_store_key(item, KEY_LINE, newSViv(line));
+    }
+
+    if (entry->multivalue) {
+        AV *av = newAV();
+        struct vparse_list *list;
+        for (list = entry->v.values; list; list = list->next)
+            av_push(av, str_u(list->s));
+        hv_store_key(item, KEY_VALUES, newRV_noinc( (SV *) av));
+    }
+    else {
+        hv_store_key(item, KEY_VALUE, _value2sv(aTHX_ entry, is_utf8, source));
+    }
+
+    if (entry->params)
+        hv_store_key(item, KEY_PARAMS, newRV_noinc( (SV *) _params2perl(aTHX_ entry->params, is_utf8, shared)));
+
+    return item;
+}
+
+/* all the entries with the same name as first, which is the first of
+ * them, through the card's index if it has one */
+static AV *_samename2perl(pTHX_ struct vparse_card *card, struct vparse_entry *first, int is_utf8,
+                          struct vparse_state *state, SV *source, HV *shared)
+{
+    struct vparse_entry *entry;
+    SSize_t n = 0;
+    AV *av = newAV();
+
+    for (entry = first; entry; entry = vparse_card_find(card, NULL, first->name, entry))
+        n++;
+    av_extend(av, n - 1);
+    for (entry = first; entry; entry = vparse_card_find(card, NULL, first->name, entry))
+        av_push(av, newRV_noinc( (SV *) _entry2perl(aTHX_ entry, is_utf8, state, source, shared)));
+
+    return av;
+}
+
+static HV *_props2perl(pTHX_ struct vparse_card *card, int is_utf8, struct vparse_state *state,
+                       SV *source, HV *shared)
 {
-    struct vparse_card *sub;
     struct vparse_entry *entry;
-    HV *res = newHV();
     HV *prophash = newHV();
 
+    /* each name once, at its first entry */
+    for (entry = card->properties; entry; entry = entry->next) {
+        if (vparse_card_find(card, NULL, entry->name, NULL) != entry)
+            continue;
+        hv_store(prophash, entry->name, strlen(entry->name),
+                 newRV_noinc( (SV *) _samename2perl(aTHX_ card, entry, is_utf8, state, source, shared)), 0);
+    }
+
+    return prophash;
+}
+
+static char *_fp_hex(const uint64_t fp[2], char *hex)
+{
+    snprintf(hex, 33, "%016llx%016llx", (unsigned long long) fp[0], (unsigned long long) fp[1]);
+    return hex;
+}
+
+static HV *_card2perl(pTHX_ struct vparse_card *card, int is_utf8, int fingerprint, struct vparse_state *state)
+{
+    struct vparse_card *sub;
+    HV *res = newHV();
+
+    /* the root holds no properties worth returning */
     if (card->type) {
-        hv_store(res, "type", 4, str_u(card->type), 0);
-        hv_store(res, "properties", 10, newRV_noinc( (SV *) prophash), 0);
+        hv_store_key(res, KEY_TYPE, str_u(card->type));
+        hv_store_key(res, KEY_PROPERTIES, newRV_noinc( (SV *) _props2perl(aTHX_ card, is_utf8, state, NULL, NULL)));
+        if (fingerprint) {
+            char hex[33];
+            hv_store_key(res, KEY_FINGERPRINT, newSVpvn(_fp_hex(card->fingerprint, hex), 32));
+        }
     }
 
     if (card->objects) {
         AV *objarray = newAV();
-        hv_store(res, "objects", 7, newRV_noinc( (SV *) objarray), 0);
+        hv_store_key(res, KEY_OBJECTS, newRV_noinc( (SV *) objarray));
         for (sub = card->objects; sub; sub = sub->next) {
-            HV *child = _card2perl(sub, is_utf8, barekeys);
+            HV *child = _card2perl(aTHX_ sub, is_utf8, fingerprint, state);
             av_push(objarray, newRV_noinc( (SV *) child));
         }
     }
 
-    for (entry = card->properties; entry; entry = entry->next) {
-        HV *item = newHV();
+    return res;
+}
 
-        if (entry->group)
-            hv_store(item, "group", 5, str_u(entry->group), 0);
+/* TUPLES
+ *
+ * Each card's entries in source order as [group, name, params, value]:
+ * params a flat name, value list and value an array for multival
+ * entries.  group and params are undef if there are none. */
 
-        hv_store(item, "name", 4, str_u(entry->name), 0);
-        if (entry->multivalue) {
-            AV *av = newAV();
-            struct vparse_list *list;
-            for (list = entry->v.values; list; list = list->next)
-                av_push(av, str_u(list->s));
-            hv_store(item, "values", 6, newRV_noinc( (SV *) av), 0);
-        }
-        else {
-            hv_store(item, "value", 5, str_u(entry->v.value), 0);
+static AV *_entry2tuple(pTHX_ struct vparse_entry *entry, int is_utf8)
+{
+    AV *tuple = newAV();
+
+    av_extend(tuple, 3);
+    av_store(tuple, 0, entry->group ? str_u(entry->group) : newSV(0));
+    av_store(tuple, 1, str_u(entry->name));
+
+    if (entry->params) {
+        struct vparse_param *param;
+        AV *params = newAV();
+        for (param = entry->params; param; param = param->next) {
+            av_push(params, str_u(param->name));
+            av_push(params, str_u(param->value));
         }
+        av_store(tuple, 2, newRV_noinc( (SV *) params));
+    }
+    else {
+        av_store(tuple, 2, newSV(0));
+    }
 
-        if (entry->params) {
-            struct vparse_param *param;
-            HV *prop = newHV();
-            for (param = entry->params; param; param = param->next) {
-                if (param->value)
-                    hv_store_aa(prop, param->name, strlen(param->name), str_u(param->value));
-                else
-                    hv_store_aa(prop, "type", 4, str_u(param->name));
-            }
-            hv_store(item, "params", 6, newRV_noinc( (SV *) prop), 0);
+    if (entry->multivalue) {
+        AV *av = newAV();
+        struct vparse_list *list;
+        for (list = entry->v.values; list; list = list->next)
+            av_push(av, str_u(list->s));
+        av_store(tuple, 3, newRV_noinc( (SV *) av));
+    }
+    else {
+        av_store(tuple, 3, str_u(entry->v.value));
+    }
+
+    return tuple;
+}
+
+static HV *_card2tuples(pTHX_ struct vparse_card *card, int is_utf8, int fingerprint)
+{
+    struct vparse_card *sub;
+    HV *res = newHV();
+
+    if (card->type) {
+        struct vparse_entry *entry;
+        AV *entries = newAV();
+
+        for (entry = card->properties; entry; entry = entry->next)
+            av_push(entries, newRV_noinc( (SV *) _entry2tuple(aTHX_ entry, is_utf8)));
+
+        hv_store(res, "type", 4, str_u(card->type), 0);
+        hv_store(res, "entries", 7, newRV_noinc( (SV *) entries), 0);
+        if (fingerprint) {
+            char hex[33];
+            hv_store(res, "fingerprint", 11, newSVpvn(_fp_hex(card->fingerprint, hex), 32), 0);
         }
-        hv_store_aa(prophash, entry->name, strlen(entry->name), newRV_noinc( (SV *) item));
+    }
+
+    if (card->objects) {
+        AV *objarray = newAV();
+        hv_store(res, "objects", 7, newRV_noinc( (SV *) objarray), 0);
+        for (sub = card->objects; sub; sub = sub->next)
+            av_push(objarray, newRV_noinc( (SV *) _card2tuples(aTHX_ sub, is_utf8, fingerprint)));
+    }
+
+    return res;
+}
+
+/* STREAMING
+ *
+ * The plain hash result, built from the parser's callbacks one entry
+ * at a time, so no tree is kept.  Each card is hooked into its parent
+ * as soon as it begins, so a croak part way through frees everything
+ * with the mortal root */
+
+struct vcardfast_sink {
+#ifdef MULTIPLICITY
+    tTHX perl;
+#endif
+    int is_utf8;
+    int fingerprint;
+    struct vparse_state *state;  /* only for line numbers */
+    SV *source;                  /* only to borrow values from */
+    HV *shared;                  /* only to share common strings */
+    AV *stack;                   /* the open cards, root first */
+};
+
+static void _sink_begin(void *rock, const char *type)
+{
+    struct vcardfast_sink *sink = rock;
+    dTHXa(sink->perl);
+    HV *parent = (HV *) AvARRAY(sink->stack)[AvFILLp(sink->stack)];
+    HV *card = newHV();
+    SV **objects = hv_fetch_key(parent, KEY_OBJECTS);
+    HV *shared = sink->shared;
+    int is_utf8 = sink->is_utf8;
+
+    if (!objects)
+        objects = hv_store_key(parent, KEY_OBJECTS, newRV_noinc( (SV *) newAV()));
+    av_push((AV *) SvRV(*objects), newRV_noinc( (SV *) card));
+
+    hv_store_key(card, KEY_TYPE, str_s(type));
+    av_push(sink->stack, SvREFCNT_inc( (SV *) card));
+}
+
+static void _sink_end(void *rock, const struct vparse_card *card)
+{
+    struct vcardfast_sink *sink = rock;
+    dTHXa(sink->perl);
+    HV *res = (HV *) AvARRAY(sink->stack)[AvFILLp(sink->stack)];
+
+    hv_store_key(res, KEY_PROPERTIES,
+                 newRV_noinc( (SV *) _props2perl(aTHX_ (struct vparse_card *) card, sink->is_utf8,
+                                                 sink->state, sink->source, sink->shared)));
+    if (sink->fingerprint) {
+        char hex[33];
+        hv_store_key(res, KEY_FINGERPRINT, newSVpvn(_fp_hex(card->fingerprint, hex), 32));
+    }
+    SvREFCNT_dec(av_pop(sink->stack));
+}
+
+static void _sink_abort(void *rock)
+{
+    struct vcardfast_sink *sink = rock;
+    dTHXa(sink->perl);
+    HV *root = (HV *) AvARRAY(sink->stack)[0];
+    AV *objects;
+
+    while (AvFILLp(sink->stack) > 0)
+        SvREFCNT_dec(av_pop(sink->stack));
+
+    /* and the broken card itself, which was the last one begun */
+    objects = (AV *) SvRV(*hv_fetch_key(root, KEY_OBJECTS));
+    SvREFCNT_dec(av_pop(objects));
+    if (av_len(objects) < 0)
+        (void) hv_delete(root, "objects", 7, G_DISCARD);
+}
+
+/* LAZY CARDS
+ *
+ * A parsed tree shared by all the lazy card objects made from it, and
+ * freed when the last of them goes away.  Each card object is a blessed
+ * hash which gets filled in from the C tree as its parts are asked for.
+ *
+ * A new thread gets its own copy of each card object but shares the
+ * tree, which is never changed once a card object can see it, so only
+ * the count needs a lock.  The one exception is fingerprints worked out
+ * when a card handle first asks, which are written under the same lock
+ * and are never output unless they were asked for at parse time */
+
+struct vcardfast_doc {
+    int refcnt;
+    int is_utf8;
+    int linenumbers;
+    int fingerprint;    /* output them */
+    int fingerprinted;  /* every card has one */
+    struct vparse_state parser;
+};
+
+struct vcardfast_lazy {
+    struct vcardfast_doc *doc;
+    struct vparse_card *card;
+    HV *byname;  /* what property() converted before properties() */
+};
+
+#ifdef USE_ITHREADS
+#  define DOC_LOCK   MUTEX_LOCK(&PL_op_mutex)
+#  define DOC_UNLOCK MUTEX_UNLOCK(&PL_op_mutex)
+#else
+#  define DOC_LOCK   NOOP
+#  define DOC_UNLOCK NOOP
+#endif
+
+static void _doc_ref(struct vcardfast_doc *doc)
+{
+    DOC_LOCK;
+    doc->refcnt++;
+    DOC_UNLOCK;
+}
+
+static void _doc_unref(struct vcardfast_doc *doc)
+{
+    int refcnt;
+
+    DOC_LOCK;
+    refcnt = --doc->refcnt;
+    DOC_UNLOCK;
+    if (refcnt)
+        return;
+    vparse_free(&doc->parser);
+    free(doc);
+}
+
+static int _lazy_free(pTHX_ SV *sv, MAGIC *mg)
+{
+    struct vcardfast_lazy *lazy = (struct vcardfast_lazy *) mg->mg_ptr;
+
+    PERL_UNUSED_ARG(sv);
+    _doc_unref(lazy->doc);
+    SvREFCNT_dec(lazy->byname);
+    free(lazy);
+    return 0;
+}
+
+#ifdef USE_ITHREADS
+static int _lazy_dup(pTHX_ MAGIC *mg, CLONE_PARAMS *param)
+{
+    struct vcardfast_lazy *lazy = malloc(sizeof(struct vcardfast_lazy));
+
+    *lazy = *(struct vcardfast_lazy *) mg->mg_ptr;
+    _doc_ref(lazy->doc);
+    lazy->byname = (HV *) sv_dup_inc( (SV *) lazy->byname, param);
+    mg->mg_ptr = (char *) lazy;
+    return 0;
+}
+#else
+#  define _lazy_dup 0
+#endif
+
+static MGVTBL _lazy_vtbl = { 0, 0, 0, 0, _lazy_free, 0, _lazy_dup, 0 };
+
+static SV *_lazy_new(pTHX_ struct vcardfast_doc *doc, struct vparse_card *card)
+{
+    int is_utf8 = doc->is_utf8;
+    struct vcardfast_lazy *lazy = malloc(sizeof(struct vcardfast_lazy));
+    HV *hv = newHV();
+    MAGIC *mg;
+
+    lazy->doc = doc;
+    lazy->card = card;
+    lazy->byname = NULL;
+    _doc_ref(doc);
+
+    hv_store(hv, "type", 4, str_u(card->type), 0);
+    if (doc->fingerprint) {
+        char hex[33];
+        hv_store(hv, "fingerprint", 11, newSVpvn(_fp_hex(card->fingerprint, hex), 32), 0);
+    }
+    mg = sv_magicext((SV *) hv, NULL, PERL_MAGIC_ext, &_lazy_vtbl, (char *) lazy, 0);
+#ifdef USE_ITHREADS
+    mg->mg_flags |= MGf_DUP;
+#endif
+
+    return sv_bless(newRV_noinc( (SV *) hv), gv_stashpv("Text::VCardFast::LazyCard", GV_ADD));
+}
+
+static struct vcardfast_lazy *_lazy_get(pTHX_ SV *self)
+{
+    MAGIC *mg;
+
+    if (!SvROK(self) || SvTYPE(SvRV(self)) != SVt_PVHV
+     || !(mg = mg_findext(SvRV(self), PERL_MAGIC_ext, &_lazy_vtbl)))
+        croak("not a Text::VCardFast::LazyCard");
+
+    return (struct vcardfast_lazy *) mg->mg_ptr;
+}
+
+static AV *_lazy_objects(pTHX_ struct vcardfast_doc *doc, struct vparse_card *card)
+{
+    struct vparse_card *sub;
+    AV *objarray = newAV();
+
+    for (sub = card->objects; sub; sub = sub->next)
+        av_push(objarray, _lazy_new(aTHX_ doc, sub));
+
+    return objarray;
+}
+
+/* CARD HANDLES
+ *
+ * An opaque object for one card of a shared tree.  Lookups by name go
+ * through the card's name index, built when the tree is parsed or
+ * the first time handles are made for it */
+
+struct vcardfast_card {
+    struct vcardfast_doc *doc;
+    struct vparse_card *card;
+};
+
+static SV *_card_new(pTHX_ struct vcardfast_doc *doc, struct vparse_card *card)
+{
+    struct vcardfast_card *handle = malloc(sizeof(struct vcardfast_card));
+    SV *res = newSV(0);
+
+    handle->doc = doc;
+    handle->card = card;
+    _doc_ref(doc);
+
+    sv_setref_pv(res, "Text::VCardFast::Card", (void *) handle);
+    return res;
+}
+
+static struct vcardfast_card *_card_get(pTHX_ SV *self)
+{
+    if (!sv_isobject(self) || !sv_derived_from(self, "Text::VCardFast::Card"))
+        croak("not a Text::VCardFast::Card");
+    return INT2PTR(struct vcardfast_card *, SvIV(SvRV(self)));
+}
+
+static AV *_card_objects(pTHX_ struct vcardfast_doc *doc, struct vparse_card *card)
+{
+    struct vparse_card *sub;
+    AV *objarray = newAV();
+
+    for (sub = card->objects; sub; sub = sub->next)
+        av_push(objarray, _card_new(aTHX_ doc, sub));
+
+    return objarray;
+}
+
+/* split a "group.name" lookup, returns the name with the group (if
+ * any) copied into groupbuf */
+static const char *_card_lookup(const char *name, char *groupbuf, size_t size,
+                                const char **groupp)
+{
+    const char *dot = strchr(name, '.');
+
+    *groupp = NULL;
+    if (!dot) return name;
+
+    /* too long to be any group we'd have */
+    if ((size_t) (dot - name) >= size) return NULL;
+    memcpy(groupbuf, name, dot - name);
+    groupbuf[dot - name] = '\0';
+    *groupp = groupbuf;
+    return dot + 1;
+}
+
+static SV *_value2perl(pTHX_ struct vparse_entry *entry, int is_utf8)
+{
+    if (entry->multivalue) {
+        AV *av = newAV();
+        struct vparse_list *list;
+        for (list = entry->v.values; list; list = list->next)
+            av_push(av, str_u(list->s));
+        return newRV_noinc( (SV *) av);
+    }
+    return str_u(entry->v.value);
+}
+
+/* DIFFS
+ *
+ * A C diff between two card handles.  It points into both trees, so
+ * holds a reference to each of their docs. */
+
+struct vcardfast_diff {
+    struct vcardfast_doc *before;
+    struct vcardfast_doc *after;
+    struct vparse_diff *diff;
+};
+
+static struct vcardfast_diff *_diff_get(pTHX_ SV *self)
+{
+    if (!sv_isobject(self) || !sv_derived_from(self, "Text::VCardFast::Diff"))
+        croak("not a Text::VCardFast::Diff");
+    return INT2PTR(struct vcardfast_diff *, SvIV(SvRV(self)));
+}
+
+static SV *_diffentry2perl(pTHX_ struct vcardfast_doc *doc, const struct vparse_entry *entry)
+{
+    HV *item = _entry2perl(aTHX_ (struct vparse_entry *) entry, doc->is_utf8,
+                           doc->linenumbers ? &doc->parser : NULL, NULL, NULL);
+    return newRV_noinc( (SV *) item);
+}
+
+/* the top level hash for a shared tree */
+static HV *_doc2perl(pTHX_ struct vcardfast_doc *doc, int lazy, int cards, int tuples)
+{
+    HV *hash;
+    struct vparse_card *root = doc->parser.card;
+
+    if (tuples)
+        return _card2tuples(aTHX_ root, doc->is_utf8, doc->fingerprint);
+
+    /* properties are grouped by name through the index, and card
+     * handles look things up in it.  A no-op if it was parsed with one */
+    vparse_index(&doc->parser);
+
+    if (!lazy && !cards)
+        return _card2perl(aTHX_ root, doc->is_utf8, doc->fingerprint,
+                          doc->linenumbers ? &doc->parser : NULL);
+
+    hash = newHV();
+    if (cards) {
+        hv_store(hash, "objects", 7, newRV_noinc( (SV *) _card_objects(aTHX_ doc, root)), 0);
+    }
+    else if (root->objects)
+        hv_store(hash, "objects", 7, newRV_noinc( (SV *) _lazy_objects(aTHX_ doc, root)), 0);
+
+    return hash;
+}
+
+static AV *_errors2perl(pTHX_ struct vparse_state *state)
+{
+    struct vparse_error *error;
+    AV *res = newAV();
+
+    for (error = state->errors; error; error = error->next) {
+        HV *item = newHV();
+        hv_store(item, "code", 4, newSViv(error->code), 0);
+        hv_store(item, "error", 5, newSVpv(vparse_errstr(error->code), 0), 0);
+        hv_store(item, "startpos", 8, newSViv(error->pos.startpos), 0);
+        hv_store(item, "startline", 9, newSViv(error->pos.startline), 0);
+        hv_store(item, "startchar", 9, newSViv(error->pos.startchar), 0);
+        hv_store(item, "errorpos", 8, newSViv(error->pos.errorpos), 0);
+        hv_store(item, "errorline", 9, newSViv(error->pos.errorline), 0);
+        hv_store(item, "errorchar", 9, newSViv(error->pos.errorchar), 0);
+        hv_store(item, "skipstart", 9, newSViv(error->skipstart), 0);
+        hv_store(item, "skipend", 7, newSViv(error->skipend), 0);
+        av_push(res, newRV_noinc( (SV *) item));
     }
 
     return res;
 }
 
-static void _die_error(struct vparse_state *state, int err)
+static void _die_error(pTHX_ struct vparse_state *state, int err)
 {
     struct vparse_errorpos pos;
     const char *src = state->base;
@@ -109,7 +763,7 @@ static void _die_error(struct vparse_state *state, int err)
           pos.startline, pos.startchar);
 }
 
-static struct vparse_list *_get_keys(SV **key)
+static struct vparse_list *_get_keys(pTHX_ SV **key)
 {
     struct vparse_list *item = NULL;
     struct vparse_list **valp = &item;
@@ -133,53 +787,1072 @@ static struct vparse_list *_get_keys(SV **key)
     return item;
 }
 
-MODULE = Text::VCardFast                PACKAGE = Text::VCardFast                
+/* name, type pairs for vparse_write_jcard from a hash, freed at
+ * the end of the calling XSUB */
+static const char **_get_types(pTHX_ SV *sv)
+{
+    const char **types;
+    HV *hv;
+    HE *he;
+    int n = 0;
 
-SV*
-_vcard2hash(src, conf)
-        const char *src;
-        HV *conf;
-    PROTOTYPE: $$
-    CODE:
-        HV *hash;
-        struct vparse_state parser;
-        struct vparse_list *multival = NULL;
-        struct vparse_list *multiparam = NULL;
-        int is_utf8 = 0;
-        int barekeys = 0;
-        int only_one = 0;
-        int r;
-        SV **key;
+    if (!sv || !SvROK(sv) || SvTYPE(SvRV(sv)) != SVt_PVHV)
+        return NULL;
 
-        if ((key = hv_fetch(conf, "multival", 8, 0)) && SvTRUE(*key))
-            multival = _get_keys(key);
+    hv = (HV *) SvRV(sv);
+    Newx(types, 2 * HvUSEDKEYS(hv) + 1, const char *);
+    SAVEFREEPV(types);
 
-        if ((key = hv_fetch(conf, "multiparam", 10, 0)) && SvTRUE(*key))
-            multiparam = _get_keys(key);
+    hv_iterinit(hv);
+    while ((he = hv_iternext(hv))) {
+        I32 len;
+        types[n++] = hv_iterkey(he, &len);
+        types[n++] = SvPV_nolen(hv_iterval(hv, he));
+    }
+    types[n] = NULL;
 
-        if ((key = hv_fetch(conf, "is_utf8", 7, 0)) && SvTRUE(*key))
-            is_utf8 = 1;
+    return types;
+}
 
-        if ((key = hv_fetch(conf, "barekeys", 8, 0)) && SvTRUE(*key))
-            barekeys = 1;
+/* PARSE CACHE
+ *
+ * Parsed trees for recently seen inputs, looked up by a hash of the
+ * source and every option which changes the result of the parse.  The
+ * cache holds a reference on each doc, so entries can be evicted while
+ * lazy cards or handles still use them.  Least recently used entries
+ * are evicted once the total size goes over the limit.  Sizes are
+ * approximate: twice the source length, the tree is usually smaller */
 
-        if ((key = hv_fetch(conf, "only_one", 8, 0)) && SvTRUE(*key))
-            only_one = 1;
+struct vcardfast_cached {
+    uint64_t hash[2];
+    char *key;
+    size_t keylen;
+    size_t size;
+    struct vcardfast_doc *doc;
+    struct vcardfast_cached *hnext;
+    struct vcardfast_cached *prev;
+    struct vcardfast_cached *next;
+};
 
-        memset(&parser, 0, sizeof(struct vparse_state));
-        parser.base = src;
-        parser.multival = multival;
-        parser.multiparam = multiparam;
-        parser.barekeys = barekeys;
+struct vcardfast_cache {
+    struct vcardfast_cached **buckets;
+    size_t nbuckets;
+    struct vcardfast_cached *head;
+    struct vcardfast_cached *tail;
+    size_t entries;
+    size_t bytes;
+    size_t maxbytes;
+    UV hits;
+    UV misses;
+    UV evictions;
+};
 
-        r = vparse_parse(&parser, only_one);
-        if (r) _die_error(&parser, r);
+#define CACHE_MAXBYTES (16 * 1024 * 1024)
 
-        hash = _card2perl(parser.card, is_utf8, barekeys);
+static void _cache_unlink(struct vcardfast_cache *cache, struct vcardfast_cached *item)
+{
+    struct vcardfast_cached **hp = &cache->buckets[item->hash[0] & (cache->nbuckets - 1)];
 
-        vparse_free(&parser);
+    while (*hp != item)
+        hp = &(*hp)->hnext;
+    *hp = item->hnext;
 
-        RETVAL = newRV_noinc( (SV *) hash);
-    OUTPUT:
-        RETVAL
+    if (item->prev) item->prev->next = item->next;
+    else cache->head = item->next;
+    if (item->next) item->next->prev = item->prev;
+    else cache->tail = item->prev;
 
+    cache->entries--;
+    cache->bytes -= item->size;
+
+    _doc_unref(item->doc);
+    free(item->key);
+    free(item);
+}
+
+static void _cache_shrink(struct vcardfast_cache *cache, size_t maxbytes)
+{
+    while (cache->tail && cache->bytes > maxbytes) {
+        _cache_unlink(cache, cache->tail);
+        cache->evictions++;
+    }
+}
+
+static struct vcardfast_doc *_cache_find(struct vcardfast_cache *cache, const uint64_t hash[2], const char *key, size_t keylen)
+{
+    struct vcardfast_cached *item;
+
+    if (cache->nbuckets) {
+        item = cache->buckets[hash[0] & (cache->nbuckets - 1)];
+        for (; item; item = item->hnext) {
+            if (item->hash[0] != hash[0] || item->hash[1] != hash[1]
+             || item->keylen != keylen || memcmp(item->key, key, keylen))
+                continue;
+
+            /* move to the front */
+            if (item->prev) {
+                item->prev->next = item->next;
+                if (item->next) item->next->prev = item->prev;
+                else cache->tail = item->prev;
+                item->prev = NULL;
+                item->next = cache->head;
+                cache->head->prev = item;
+                cache->head = item;
+            }
+
+            cache->hits++;
+            return item->doc;
+        }
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+static void _cache_add(struct vcardfast_cache *cache, const uint64_t hash[2],
+                       const char *key, size_t keylen,
+                       struct vcardfast_doc *doc)
+{
+    struct vcardfast_cached *item;
+    size_t size = keylen * 2 + sizeof(struct vcardfast_cached) + sizeof(struct vcardfast_doc);
+    size_t i;
+
+    if (size > cache->maxbytes)
+        return;
+    _cache_shrink(cache, cache->maxbytes - size);
+
+    if (cache->entries >= cache->nbuckets) {
+        size_t nbuckets = cache->nbuckets ? cache->nbuckets * 2 : 64;
+        struct vcardfast_cached **buckets = calloc(nbuckets, sizeof(struct vcardfast_cached *));
+        for (i = 0; i < cache->nbuckets; i++) {
+            struct vcardfast_cached *next;
+            for (item = cache->buckets[i]; item; item = next) {
+                next = item->hnext;
+                item->hnext = buckets[item->hash[0] & (nbuckets - 1)];
+                buckets[item->hash[0] & (nbuckets - 1)] = item;
+            }
+        }
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->nbuckets = nbuckets;
+    }
+
+    item = malloc(sizeof(struct vcardfast_cached));
+    item->hash[0] = hash[0];
+    item->hash[1] = hash[1];
+    item->key = malloc(keylen);
+    memcpy(item->key, key, keylen);
+    item->keylen = keylen;
+    item->size = size;
+    item->doc = doc;
+    _doc_ref(doc);
+
+    item->hnext = cache->buckets[hash[0] & (cache->nbuckets - 1)];
+    cache->buckets[hash[0] & (cache->nbuckets - 1)] = item;
+
+    item->prev = NULL;
+    item->next = cache->head;
+    if (cache->head) cache->head->prev = item;
+    else cache->tail = item;
+    cache->head = item;
+
+    cache->entries++;
+    cache->bytes += size;
+}
+
+/* everything that changes the parse result, followed by the source */
+static SV *_cache_key(pTHX_ const char *src, STRLEN len, struct vparse_state *parser,
+                      int from_jcard, int only_one, int is_utf8, int linenumbers)
+{
+    struct vparse_list *item;
+    SV *key = newSVpvf("%d%d%d%d%d%d%d", from_jcard, parser->barekeys, parser->recover,
+                       parser->fingerprint, only_one, is_utf8, linenumbers);
+
+    /* length prefixed, so no two lists of names run together the same */
+    for (item = parser->multival; item; item = item->next)
+        sv_catpvf(key, "v%d:%s", (int) strlen(item->s), item->s);
+    sv_catpvn(key, "\0", 1);
+    for (item = parser->multiparam; item; item = item->next)
+        sv_catpvf(key, "p%d:%s", (int) strlen(item->s), item->s);
+    sv_catpvn(key, "\0", 1);
+    sv_catpvn(key, src, len);
+
+    return key;
+}
+
+static void _free_keys(struct vparse_list *item)
+{
+    struct vparse_list *next;
+
+    for (; item; item = next) {
+        next = item->next;
+        free(item->s);
+        free(item);
+    }
+}
+
+/* takes over the parser, indexing the source first if line numbers
+ * will be wanted, because the source goes away after this call */
+static struct vcardfast_doc *_doc_new(struct vparse_state *parser, int is_utf8, int linenumbers)
+{
+    struct vcardfast_doc *doc = malloc(sizeof(struct vcardfast_doc));
+    int line, col;
+
+    if (linenumbers)
+        vparse_linepos(parser, 0, &line, &col);
+    parser->base = NULL;
+    parser->multival = NULL;
+    parser->multiparam = NULL;
+
+    doc->refcnt = 1;
+    doc->is_utf8 = is_utf8;
+    doc->linenumbers = linenumbers;
+    doc->fingerprint = parser->fingerprint;
+    doc->fingerprinted = parser->fingerprint;
+    doc->parser = *parser;
+
+    return doc;
+}
+
+/* PER INTERPRETER STATE
+ *
+ * Everything that holds perl values or is reused between calls, so
+ * each thread starts out with its own.  A new thread gets an empty
+ * cache and pool, the parent's are still the parent's.  All of it is
+ * freed with the interpreter, which for a thread is when it ends */
+
+#define MY_CXT_KEY "Text::VCardFast::_guts" XS_VERSION
+
+typedef struct {
+    struct vcardfast_cache cache;
+    HV *shared[2];
+    struct vparse_pool pool;
+} my_cxt_t;
+
+START_MY_CXT
+
+static void _cxt_init(pTHX_ my_cxt_t *cxt, size_t maxbytes)
+{
+    memset(cxt, 0, sizeof(my_cxt_t));
+    cxt->cache.maxbytes = maxbytes;
+    _shared_init(aTHX_ cxt->shared);
+}
+
+/* on the exit list, which new threads copy, so it runs for each of
+ * them with their own state.  Objects are gone by now but every other
+ * value is still there */
+static void _cxt_free(pTHX_ void *unused)
+{
+    dMY_CXT;
+    int utf8;
+
+    PERL_UNUSED_ARG(unused);
+    while (MY_CXT.cache.tail)
+        _cache_unlink(&MY_CXT.cache, MY_CXT.cache.tail);
+    free(MY_CXT.cache.buckets);
+    MY_CXT.cache.buckets = NULL;
+    MY_CXT.cache.nbuckets = 0;
+    vparse_pool_free(&MY_CXT.pool);
+    for (utf8 = 0; utf8 < 2; utf8++) {
+        SvREFCNT_dec(MY_CXT.shared[utf8]);
+        MY_CXT.shared[utf8] = NULL;
+    }
+}
+
+MODULE = Text::VCardFast                PACKAGE = Text::VCardFast                
+
+BOOT:
+        MY_CXT_INIT;
+        _cxt_init(aTHX_ &MY_CXT, CACHE_MAXBYTES);
+        call_atexit(_cxt_free, NULL);
+        _keys_init();
+
+void
+CLONE(...)
+    CODE:
+        size_t maxbytes;
+        {
+            dMY_CXT;
+            maxbytes = MY_CXT.cache.maxbytes;
+        }
+        {
+            MY_CXT_CLONE;
+            _cxt_init(aTHX_ &MY_CXT, maxbytes);
+        }
+        PERL_UNUSED_VAR(items);
+
+SV*
+_vcard2hash(src, conf)
+        SV *src;
+        HV *conf;
+    PROTOTYPE: $$
+    CODE:
+        dMY_CXT;
+        HV *hash;
+        HV *root = NULL;
+        struct vparse_state parser;
+        struct vparse_sink callbacks;
+        struct vcardfast_sink sink;
+        struct vcardfast_doc *doc = NULL;
+        SV *cachekey = NULL;
+        uint64_t cachehash[2];
+        const char *data;
+        STRLEN len;
+        int is_utf8 = 0;
+        int only_one = 0;
+        int linenumbers = 0;
+        int lazy = 0;
+        int cards = 0;
+        int tuples = 0;
+        int blob = 0;
+        int canonical = 0;
+        int jcard = 0;
+        int text = 0;
+        int json = 0;
+        int from_jcard = 0;
+        int usecache = 0;
+        int borrow = 0;
+        int shared = 0;
+        int r;
+        SV **key;
+
+        memset(&parser, 0, sizeof(struct vparse_state));
+
+        if ((key = hv_fetch(conf, "multival", 8, 0)) && SvTRUE(*key))
+            parser.multival = _get_keys(aTHX_ key);
+
+        if ((key = hv_fetch(conf, "multiparam", 10, 0)) && SvTRUE(*key))
+            parser.multiparam = _get_keys(aTHX_ key);
+
+        if ((key = hv_fetch(conf, "is_utf8", 7, 0)) && SvTRUE(*key))
+            is_utf8 = 1;
+
+        if ((key = hv_fetch(conf, "barekeys", 8, 0)) && SvTRUE(*key))
+            parser.barekeys = 1;
+
+        if ((key = hv_fetch(conf, "only_one", 8, 0)) && SvTRUE(*key))
+            only_one = 1;
+
+        if ((key = hv_fetch(conf, "recover", 7, 0)) && SvTRUE(*key))
+            parser.recover = 1;
+
+        if ((key = hv_fetch(conf, "linenumbers", 11, 0)) && SvTRUE(*key))
+            linenumbers = 1;
+
+        if ((key = hv_fetch(conf, "lazy", 4, 0)) && SvTRUE(*key))
+            lazy = 1;
+
+        if ((key = hv_fetch(conf, "cards", 5, 0)) && SvTRUE(*key))
+            cards = 1;
+
+        if ((key = hv_fetch(conf, "tuples", 6, 0)) && SvTRUE(*key))
+            tuples = 1;
+
+        if ((key = hv_fetch(conf, "blob", 4, 0)) && SvTRUE(*key))
+            blob = 1;
+
+        if ((key = hv_fetch(conf, "canonical", 9, 0)) && SvTRUE(*key))
+            canonical = 1;
+
+        if ((key = hv_fetch(conf, "jcard", 5, 0)) && SvTRUE(*key))
+            jcard = 1;
+
+        if ((key = hv_fetch(conf, "text", 4, 0)) && SvTRUE(*key))
+            text = 1;
+
+        if ((key = hv_fetch(conf, "json", 4, 0)) && SvTRUE(*key))
+            json = 1;
+
+        if ((key = hv_fetch(conf, "from_jcard", 10, 0)) && SvTRUE(*key))
+            from_jcard = 1;
+
+        if ((key = hv_fetch(conf, "fingerprint", 11, 0)) && SvTRUE(*key))
+            parser.fingerprint = 1;
+
+        if ((key = hv_fetch(conf, "structural", 10, 0)) && SvTRUE(*key)) {
+            const char *how = SvPV_nolen(*key);
+            if (!strcmp(how, "sse2"))
+                parser.structural = VPARSE_STRUCTURAL_SSE2;
+            else if (!strcmp(how, "scalar"))
+                parser.structural = VPARSE_STRUCTURAL_SCALAR;
+            else
+                parser.structural = VPARSE_STRUCTURAL_BEST;
+        }
+
+        if ((key = hv_fetch(conf, "borrow", 6, 0)) && SvTRUE(*key))
+            borrow = 1;
+
+        if ((key = hv_fetch(conf, "shared", 6, 0)) && SvTRUE(*key))
+            shared = 1;
+
+        /* card handles look things up by name, and hashes group by it */
+        parser.index = cards;
+
+        if ((key = hv_fetch(conf, "cache", 5, 0)) && SvTRUE(*key))
+            usecache = MY_CXT.cache.maxbytes ? 1 : 0;
+
+        data = SvPV(src, len);
+
+        if (usecache) {
+            const char *k;
+            STRLEN klen;
+            cachekey = sv_2mortal(_cache_key(aTHX_ data, len, &parser, from_jcard, only_one, is_utf8, linenumbers));
+            k = SvPV(cachekey, klen);
+            vparse_hash128(k, klen, 0, cachehash);
+            doc = _cache_find(&MY_CXT.cache, cachehash, k, klen);
+            if (doc) _doc_ref(doc);
+        }
+
+        /* a plain hash needs no tree at all */
+        if (!(lazy || cards || tuples || blob || canonical || jcard || text
+              || json || from_jcard || usecache)) {
+            root = (HV *) sv_2mortal( (SV *) newHV());
+#ifdef MULTIPLICITY
+            sink.perl = aTHX;
+#endif
+            sink.is_utf8 = is_utf8;
+            sink.fingerprint = parser.fingerprint;
+            sink.state = linenumbers ? &parser : NULL;
+            sink.stack = (AV *) sv_2mortal( (SV *) newAV());
+            sink.source = NULL;
+            sink.shared = shared ? MY_CXT.shared[is_utf8] : NULL;
+            if (borrow) {
+                /* shares the caller's buffer unless it can't be shared */
+                sink.source = sv_newmortal();
+                sv_setsv_flags(sink.source, src, SV_GMAGIC|SV_COW_SHARED_HASH_KEYS|SV_COW_OTHER_PVS);
+                if (!SvPOK(sink.source) || SvCUR(sink.source) != len)
+                    sink.source = NULL;
+            }
+            av_push(sink.stack, SvREFCNT_inc( (SV *) root));
+            callbacks.rock = &sink;
+            callbacks.begin_card = _sink_begin;
+            callbacks.end_card = _sink_end;
+            callbacks.abort_card = _sink_abort;
+            parser.sink = &callbacks;
+            parser.index = 1;
+        }
+
+        if (!doc) {
+            parser.base = data;
+            vparse_pool_get(&parser, &MY_CXT.pool);
+
+            if (from_jcard)
+                r = vparse_parse_jcard(&parser);
+            else
+                r = vparse_parse(&parser, only_one);
+            _free_keys(parser.multival);
+            _free_keys(parser.multiparam);
+            if (r) _die_error(aTHX_ &parser, r);
+
+            if (!root)
+                doc = _doc_new(&parser, is_utf8, linenumbers);
+            if (usecache) {
+                const char *k;
+                STRLEN klen;
+                k = SvPV(cachekey, klen);
+                _cache_add(&MY_CXT.cache, cachehash, k, klen, doc);
+            }
+        }
+        else {
+            _free_keys(parser.multival);
+            _free_keys(parser.multiparam);
+        }
+
+        if (root) {
+            if (parser.recover)
+                hv_store(root, "errors", 6, newRV_noinc( (SV *) _errors2perl(aTHX_ &parser)), 0);
+            vparse_pool_put(&parser, &MY_CXT.pool);
+            vparse_free(&parser);
+
+            RETVAL = newRV_inc( (SV *) root);
+        }
+        else if (blob) {
+            struct buf buf = BUF_INITIALIZER;
+
+            vparse_freeze(&buf, doc->parser.card, doc->is_utf8 ? VPARSE_BLOB_UTF8 : 0);
+
+            RETVAL = newSVpvn(buf.s, buf.len);
+            vparse_buf_free(&buf);
+        }
+        else if (jcard) {
+            struct buf buf = BUF_INITIALIZER;
+
+            key = hv_fetch(conf, "types", 5, 0);
+            vparse_write_jcard(&buf, doc->parser.card, _get_types(aTHX_ key ? *key : NULL));
+
+            RETVAL = newSVpvn(buf.s, buf.len);
+            vparse_buf_free(&buf);
+        }
+        else if (json) {
+            struct buf buf = BUF_INITIALIZER;
+            int flags = 0;
+
+            if (doc->linenumbers) flags |= VPARSE_JSON_LINES;
+            if (doc->fingerprint) flags |= VPARSE_JSON_FINGERPRINT;
+            if (doc->parser.recover) flags |= VPARSE_JSON_ERRORS;
+            vparse_write_json(&buf, &doc->parser, flags);
+
+            RETVAL = newSVpvn(buf.s, buf.len);
+            vparse_buf_free(&buf);
+        }
+        else if (text) {
+            struct buf buf = BUF_INITIALIZER;
+            const char *eol = NULL;
+
+            if ((key = hv_fetch(conf, "eol", 3, 0)) && SvOK(*key))
+                eol = SvPV_nolen(*key);
+            vparse_write_card(&buf, doc->parser.card, eol);
+
+            RETVAL = newSVpvn(buf.s, buf.len);
+            if (doc->is_utf8)
+                SvUTF8_on(RETVAL);
+            vparse_buf_free(&buf);
+        }
+        else if (canonical) {
+            struct buf buf = BUF_INITIALIZER;
+
+            vparse_write_canonical(&buf, doc->parser.card);
+
+            RETVAL = newSVpvn(buf.s, buf.len);
+            if (doc->is_utf8)
+                SvUTF8_on(RETVAL);
+            vparse_buf_free(&buf);
+        }
+        else {
+            hash = _doc2perl(aTHX_ doc, lazy, cards, tuples);
+
+            if (doc->parser.recover)
+                hv_store(hash, "errors", 6, newRV_noinc( (SV *) _errors2perl(aTHX_ &doc->parser)), 0);
+
+            RETVAL = newRV_noinc( (SV *) hash);
+        }
+
+        if (doc)
+            _doc_unref(doc);
+    OUTPUT:
+        RETVAL
+
+SV*
+cache_size(...)
+    PROTOTYPE: ;$
+    CODE:
+        dMY_CXT;
+        RETVAL = newSVuv(MY_CXT.cache.maxbytes);
+        if (items > 0) {
+            MY_CXT.cache.maxbytes = SvUV(ST(0));
+            _cache_shrink(&MY_CXT.cache, MY_CXT.cache.maxbytes);
+        }
+    OUTPUT:
+        RETVAL
+
+void
+cache_clear()
+    PROTOTYPE:
+    CODE:
+        dMY_CXT;
+        while (MY_CXT.cache.tail)
+            _cache_unlink(&MY_CXT.cache, MY_CXT.cache.tail);
+
+SV*
+cache_stats()
+    PROTOTYPE:
+    CODE:
+        dMY_CXT;
+        HV *stats = newHV();
+        hv_store(stats, "hits", 4, newSVuv(MY_CXT.cache.hits), 0);
+        hv_store(stats, "misses", 6, newSVuv(MY_CXT.cache.misses), 0);
+        hv_store(stats, "evictions", 9, newSVuv(MY_CXT.cache.evictions), 0);
+        hv_store(stats, "entries", 7, newSVuv(MY_CXT.cache.entries), 0);
+        hv_store(stats, "bytes", 5, newSVuv(MY_CXT.cache.bytes), 0);
+        hv_store(stats, "max_bytes", 9, newSVuv(MY_CXT.cache.maxbytes), 0);
+        RETVAL = newRV_noinc( (SV *) stats);
+    OUTPUT:
+        RETVAL
+
+SV*
+_blob2hash(src, conf)
+        SV *src;
+        HV *conf;
+    PROTOTYPE: $$
+    CODE:
+        struct vparse_card *root;
+        struct vcardfast_doc *doc;
+        const char *data;
+        STRLEN len;
+        HV *hash;
+        int flags = 0;
+        int lazy = 0;
+        int cards = 0;
+        int tuples = 0;
+        int fingerprint = 0;
+        int r;
+        SV **key;
+
+        if ((key = hv_fetch(conf, "lazy", 4, 0)) && SvTRUE(*key))
+            lazy = 1;
+
+        if ((key = hv_fetch(conf, "fingerprint", 11, 0)) && SvTRUE(*key))
+            fingerprint = 1;
+
+        if ((key = hv_fetch(conf, "cards", 5, 0)) && SvTRUE(*key))
+            cards = 1;
+
+        if ((key = hv_fetch(conf, "tuples", 6, 0)) && SvTRUE(*key))
+            tuples = 1;
+
+        data = SvPVbyte(src, len);
+        r = vparse_thaw(data, len, &root, &flags);
+        if (r) croak("error %s", vparse_errstr(r));
+
+        doc = malloc(sizeof(struct vcardfast_doc));
+        memset(doc, 0, sizeof(struct vcardfast_doc));
+        doc->refcnt = 1;
+        doc->is_utf8 = (flags & VPARSE_BLOB_UTF8) ? 1 : 0;
+        doc->parser.card = root;
+
+        /* not stored in the blob */
+        if (fingerprint) {
+            vparse_fingerprint(root);
+            doc->fingerprint = 1;
+            doc->fingerprinted = 1;
+        }
+
+        hash = _doc2perl(aTHX_ doc, lazy, cards, tuples);
+
+        _doc_unref(doc);
+
+        RETVAL = newRV_noinc( (SV *) hash);
+    OUTPUT:
+        RETVAL
+
+
+MODULE = Text::VCardFast                PACKAGE = Text::VCardFast::LazyCard
+
+SV*
+properties(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_lazy *lazy = _lazy_get(aTHX_ self);
+        HV *hv = (HV *) SvRV(self);
+        SV **key;
+
+        if ((key = hv_fetch(hv, "properties", 10, 0))) {
+            RETVAL = newSVsv(*key);
+        }
+        else {
+            struct vcardfast_doc *doc = lazy->doc;
+            HV *prophash = newHV();
+            HV *byname = lazy->byname;
+            struct vparse_entry *entry;
+
+            /* reuse whatever property() already converted */
+            /* each name once, at its first entry */
+            for (entry = lazy->card->properties; entry; entry = entry->next) {
+                I32 len = strlen(entry->name);
+                if (vparse_card_find(lazy->card, NULL, entry->name, NULL) != entry)
+                    continue;
+                if (byname && (key = hv_fetch(byname, entry->name, len, 0))) {
+                    hv_store(prophash, entry->name, len, SvREFCNT_inc(*key), 0);
+                    continue;
+                }
+                hv_store(prophash, entry->name, len,
+                         newRV_noinc( (SV *) _samename2perl(aTHX_ lazy->card, entry, doc->is_utf8,
+                                          doc->linenumbers ? &doc->parser : NULL, NULL, NULL)), 0);
+            }
+
+            RETVAL = newRV_noinc( (SV *) prophash);
+            hv_store(hv, "properties", 10, newSVsv(RETVAL), 0);
+            SvREFCNT_dec(byname);
+            lazy->byname = NULL;
+        }
+    OUTPUT:
+        RETVAL
+
+SV*
+property(self, name)
+        SV *self;
+        const char *name;
+    PROTOTYPE: $$
+    CODE:
+        struct vcardfast_lazy *lazy = _lazy_get(aTHX_ self);
+        HV *hv = (HV *) SvRV(self);
+        I32 len = strlen(name);
+        SV **key;
+
+        if ((key = hv_fetch(hv, "properties", 10, 0))) {
+            key = hv_fetch((HV *) SvRV(*key), name, len, 0);
+            RETVAL = key ? newSVsv(*key) : &PL_sv_undef;
+        }
+        else {
+            HV *byname = lazy->byname;
+
+            if (!byname)
+                byname = lazy->byname = newHV();
+
+            if ((key = hv_fetch(byname, name, len, 0))) {
+                RETVAL = newSVsv(*key);
+            }
+            else {
+                struct vcardfast_doc *doc = lazy->doc;
+                struct vparse_entry *entry;
+                AV *av = NULL;
+
+                for (entry = lazy->card->properties; entry; entry = entry->next) {
+                    if (strcmp(entry->name, name))
+                        continue;
+                    if (!av) av = newAV();
+                    av_push(av, newRV_noinc( (SV *) _entry2perl(aTHX_ entry, doc->is_utf8,
+                                               doc->linenumbers ? &doc->parser : NULL, NULL, NULL)));
+                }
+
+                if (av) {
+                    RETVAL = newRV_noinc( (SV *) av);
+                    hv_store(byname, name, len, newSVsv(RETVAL), 0);
+                }
+                else {
+                    RETVAL = &PL_sv_undef;
+                }
+            }
+        }
+    OUTPUT:
+        RETVAL
+
+SV*
+objects(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_lazy *lazy = _lazy_get(aTHX_ self);
+        HV *hv = (HV *) SvRV(self);
+        SV **key;
+
+        if ((key = hv_fetch(hv, "objects", 7, 0))) {
+            RETVAL = newSVsv(*key);
+        }
+        else {
+            RETVAL = newRV_noinc( (SV *) _lazy_objects(aTHX_ lazy->doc, lazy->card));
+            hv_store(hv, "objects", 7, newSVsv(RETVAL), 0);
+        }
+    OUTPUT:
+        RETVAL
+
+SV*
+as_hash(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_lazy *lazy = _lazy_get(aTHX_ self);
+        struct vcardfast_doc *doc = lazy->doc;
+        HV *hash = _card2perl(aTHX_ lazy->card, doc->is_utf8, doc->fingerprint,
+                              doc->linenumbers ? &doc->parser : NULL);
+        RETVAL = newRV_noinc( (SV *) hash);
+    OUTPUT:
+        RETVAL
+
+MODULE = Text::VCardFast                PACKAGE = Text::VCardFast::Card
+
+void
+DESTROY(self)
+        SV *self;
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        _doc_unref(handle->doc);
+        free(handle);
+
+SV*
+type(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        int is_utf8 = handle->doc->is_utf8;
+        RETVAL = str_u(handle->card->type);
+    OUTPUT:
+        RETVAL
+
+SV*
+get(self, name)
+        SV *self;
+        const char *name;
+    PROTOTYPE: $$
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct vparse_entry *entry = NULL;
+        const char *group;
+        char groupbuf[256];
+
+        name = _card_lookup(name, groupbuf, sizeof(groupbuf), &group);
+        if (name) entry = vparse_card_find(handle->card, group, name, NULL);
+
+        RETVAL = entry ? _value2perl(aTHX_ entry, handle->doc->is_utf8) : &PL_sv_undef;
+    OUTPUT:
+        RETVAL
+
+void
+values(self, name)
+        SV *self;
+        const char *name;
+    PROTOTYPE: $$
+    PPCODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct vparse_entry *entry = NULL;
+        const char *group;
+        char groupbuf[256];
+
+        name = _card_lookup(name, groupbuf, sizeof(groupbuf), &group);
+        if (name) entry = vparse_card_find(handle->card, group, name, NULL);
+
+        for (; entry; entry = vparse_card_find(handle->card, group, name, entry))
+            XPUSHs(sv_2mortal(_value2perl(aTHX_ entry, handle->doc->is_utf8)));
+
+void
+param(self, name, pname)
+        SV *self;
+        const char *name;
+        const char *pname;
+    PROTOTYPE: $$$
+    PPCODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        int is_utf8 = handle->doc->is_utf8;
+        struct vparse_entry *entry = NULL;
+        struct vparse_param *param;
+        const char *group;
+        char groupbuf[256];
+
+        name = _card_lookup(name, groupbuf, sizeof(groupbuf), &group);
+        if (name) entry = vparse_card_find(handle->card, group, name, NULL);
+
+        /* bare params are types, as in the hash */
+        if (entry) {
+            for (param = entry->params; param; param = param->next) {
+                if (!strcasecmp(PARAM_KEY(param), pname))
+                    XPUSHs(sv_2mortal(str_u(PARAM_VALUE(param))));
+            }
+        }
+
+void
+names(self)
+        SV *self;
+    PROTOTYPE: $
+    PPCODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        int is_utf8 = handle->doc->is_utf8;
+        struct vparse_entry *entry, *prev;
+
+        for (entry = handle->card->properties; entry; entry = entry->next) {
+            for (prev = handle->card->properties; prev != entry; prev = prev->next)
+                if (!strcmp(prev->name, entry->name)) break;
+            if (prev == entry)
+                XPUSHs(sv_2mortal(str_u(entry->name)));
+        }
+
+void
+groups(self)
+        SV *self;
+    PROTOTYPE: $
+    PPCODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        int is_utf8 = handle->doc->is_utf8;
+        struct vparse_entry *entry, *prev;
+
+        for (entry = handle->card->properties; entry; entry = entry->next) {
+            if (!entry->group) continue;
+            for (prev = handle->card->properties; prev != entry; prev = prev->next)
+                if (prev->group && !strcmp(prev->group, entry->group)) break;
+            if (prev == entry)
+                XPUSHs(sv_2mortal(str_u(entry->group)));
+        }
+
+void
+objects(self)
+        SV *self;
+    PROTOTYPE: $
+    PPCODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct vparse_card *sub;
+
+        for (sub = handle->card->objects; sub; sub = sub->next)
+            XPUSHs(sv_2mortal(_card_new(aTHX_ handle->doc, sub)));
+
+SV*
+to_string(self, eol = NULL)
+        SV *self;
+        const char *eol;
+    PROTOTYPE: $;$
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct buf buf = BUF_INITIALIZER;
+
+        vparse_write_card(&buf, handle->card, eol);
+        RETVAL = newSVpvn(buf.s, buf.len);
+        if (handle->doc->is_utf8)
+            SvUTF8_on(RETVAL);
+        vparse_buf_free(&buf);
+    OUTPUT:
+        RETVAL
+
+SV*
+diff(self, other)
+        SV *self;
+        SV *other;
+    PROTOTYPE: $$
+    CODE:
+        struct vcardfast_card *a = _card_get(aTHX_ self);
+        struct vcardfast_card *b = _card_get(aTHX_ other);
+        struct vcardfast_diff *diff = malloc(sizeof(struct vcardfast_diff));
+
+        diff->before = a->doc;
+        diff->after = b->doc;
+        diff->diff = vparse_diff(a->card, b->card);
+        _doc_ref(a->doc);
+        _doc_ref(b->doc);
+
+        RETVAL = newSV(0);
+        sv_setref_pv(RETVAL, "Text::VCardFast::Diff", (void *) diff);
+    OUTPUT:
+        RETVAL
+
+SV*
+to_canonical(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct buf buf = BUF_INITIALIZER;
+
+        vparse_write_canonical(&buf, handle->card);
+        RETVAL = newSVpvn(buf.s, buf.len);
+        if (handle->doc->is_utf8)
+            SvUTF8_on(RETVAL);
+        vparse_buf_free(&buf);
+    OUTPUT:
+        RETVAL
+
+SV*
+to_jcard(self, types = NULL)
+        SV *self;
+        SV *types;
+    PROTOTYPE: $;$
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct buf buf = BUF_INITIALIZER;
+
+        vparse_write_jcard(&buf, handle->card, _get_types(aTHX_ types));
+        RETVAL = newSVpvn(buf.s, buf.len);
+        vparse_buf_free(&buf);
+    OUTPUT:
+        RETVAL
+
+SV*
+fingerprint(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        char hex[33];
+
+        DOC_LOCK;
+        if (!handle->doc->fingerprinted) {
+            vparse_fingerprint(handle->doc->parser.card);
+            handle->doc->fingerprinted = 1;
+        }
+        DOC_UNLOCK;
+        RETVAL = newSVpvn(_fp_hex(handle->card->fingerprint, hex), 32);
+    OUTPUT:
+        RETVAL
+
+SV*
+to_blob(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct buf buf = BUF_INITIALIZER;
+
+        vparse_freeze(&buf, handle->card, handle->doc->is_utf8 ? VPARSE_BLOB_UTF8 : 0);
+        RETVAL = newSVpvn(buf.s, buf.len);
+        vparse_buf_free(&buf);
+    OUTPUT:
+        RETVAL
+
+SV*
+as_hash(self)
+        SV *self;
+    PROTOTYPE: $
+    CODE:
+        struct vcardfast_card *handle = _card_get(aTHX_ self);
+        struct vcardfast_doc *doc = handle->doc;
+        HV *hash = _card2perl(aTHX_ handle->card, doc->is_utf8, doc->fingerprint,
+                              doc->linenumbers ? &doc->parser : NULL);
+        RETVAL = newRV_noinc( (SV *) hash);
+    OUTPUT:
+        RETVAL
+
+
+MODULE = Text::VCardFast                PACKAGE = Text::VCardFast::Diff
+
+void
+DESTROY(self)
+        SV *self;
+    CODE:
+        struct vcardfast_diff *diff = _diff_get(aTHX_ self);
+        vparse_diff_free(diff->diff);
+        _doc_unref(diff->before);
+        _doc_unref(diff->after);
+        free(diff);
+
+void
+changes(self)
+        SV *self;
+    PROTOTYPE: $
+    PPCODE:
+        struct vcardfast_diff *diff = _diff_get(aTHX_ self);
+        struct vparse_diff *item;
+
+        for (item = diff->diff; item; item = item->next) {
+            HV *change = newHV();
+            const char *op = item->op == VPARSE_DIFF_ADD ? "add"
+                           : item->op == VPARSE_DIFF_REMOVE ? "remove" : "change";
+
+            hv_store(change, "op", 2, newSVpv(op, 0), 0);
+            if (item->before)
+                hv_store(change, "old", 3, _diffentry2perl(aTHX_ diff->before, item->before), 0);
+            if (item->after)
+                hv_store(change, "new", 3, _diffentry2perl(aTHX_ diff->after, item->after), 0);
+            XPUSHs(sv_2mortal(newRV_noinc( (SV *) change)));
+        }
+
+SV*
+apply(self, target)
+        SV *self;
+        SV *target;
+    PROTOTYPE: $$
+    CODE:
+        struct vcardfast_diff *diff = _diff_get(aTHX_ self);
+        struct vcardfast_card *handle = _card_get(aTHX_ target);
+        struct vcardfast_doc *doc;
+        struct vparse_card *root;
+        int r;
+
+        root = calloc(1, sizeof(struct vparse_card));
+        root->objects = vparse_card_dup(handle->card);
+
+        r = vparse_patch(root->objects, diff->diff);
+
+        doc = malloc(sizeof(struct vcardfast_doc));
+        memset(doc, 0, sizeof(struct vcardfast_doc));
+        doc->refcnt = 1;
+        doc->is_utf8 = handle->doc->is_utf8;
+        doc->parser.card = root;
+
+        if (r) {
+            _doc_unref(doc);
+            croak("error %s", vparse_errstr(r));
+        }
+
+        vparse_index(&doc->parser);
+        RETVAL = _card_new(aTHX_ doc, root->objects);
+        _doc_unref(doc);
+    OUTPUT:
+        RETVAL
@@ -20,6 +20,14 @@ our @ISA = qw(Exporter);
 our %EXPORT_TAGS = ( 'all' => [ qw(
 	vcard2hash
 	hash2vcard
+	vcard2cards
+	vcard2blob
+	blob2hash
+	vcard2canonical
+	vcard2jcard
+	jcard2hash
+	jcard2vcard
+	vcard2json
 ) ] );
 
 our @EXPORT_OK = ( @{ $EXPORT_TAGS{'all'} } );
@@ -56,6 +64,51 @@ sub vcard2hash_c {
     return $hash;
 }
 
+sub vcard2cards {
+    my $vcard = shift;
+    my $hash = vcard2hash_c($vcard, @_, cards => 1);
+    return @{$hash->{objects}};
+}
+
+sub vcard2blob {
+    my $vcard = shift;
+    return vcard2hash_c($vcard, @_, blob => 1);
+}
+
+sub vcard2canonical {
+    my $vcard = shift;
+    return vcard2hash_c($vcard, @_, canonical => 1);
+}
+
+sub vcard2jcard {
+    my $vcard = shift;
+    return vcard2hash_c($vcard, @_, jcard => 1);
+}
+
+sub vcard2json {
+    my $vcard = shift;
+    return vcard2hash_c($vcard, @_, json => 1);
+}
+
+sub jcard2hash {
+    my $jcard = shift;
+    # JSON is always unicode
+    utf8::encode($jcard) if utf8::is_utf8($jcard);
+    return Text::VCardFast::_vcard2hash($jcard, { @_, is_utf8 => 1, from_jcard => 1 });
+}
+
+sub jcard2vcard {
+    my $jcard = shift;
+    my $eol = shift;
+    return jcard2hash($jcard, @_, text => 1, eol => $eol);
+}
+
+sub blob2hash {
+    my $blob = shift;
+    my %params = @_;
+    return Text::VCardFast::_blob2hash($blob, \%params);
+}
+
 # pureperl version
 
 # VCard parsing and formatting {{{
@@ -221,39 +274,56 @@ sub hash2vcardlines_pp {
 
   my @Lines;
   for my $Card (@$Objects) {
-    # We group properties in the same group together, track if we've
-    #  already output a property
-    my %DoneProps;
-
-    my $Props = $Card->{properties};
-
-    # Order the properties
-    my @PropKeys = sort {
-      ($PropOutputOrder{$a} // 1000) <=> ($PropOutputOrder{$b} // 1000)
-        || $a cmp $b
-    } keys %$Props;
-
-    # Make sure items in the same group are output together
-    my $Groups = $Card->{groups} || do {
-      my %Groups;
-      for (map { @$_ } values %$Props) {
-	push @{$Groups{$_->{group}}}, $_ if $_->{group};
-      }
-      \%Groups;
-    };
+    # Fill in everything a lazy card hasn't converted yet
+    if (ref($Card) eq 'Text::VCardFast::LazyCard') {
+      $Card->properties();
+      $Card->objects();
+    }
 
     # Generate output list
     my @OutputProps;
-    for my $PropKey (@PropKeys) {
-      my @PropVals = @{$Props->{$PropKey}};
-      for my $PropVal (@PropVals) {
-        next if $DoneProps{"$PropVal"}++;
+    if (my $Entries = $Card->{entries}) {
+      # Tuples are already in order
+      @OutputProps = map { {
+        group => $_->[0],
+        name => $_->[1],
+        paramlist => $_->[2],
+        (ref($_->[3]) ? 'values' : 'value') => $_->[3],
+      } } @$Entries;
+    }
+    else {
+      # We group properties in the same group together, track if we've
+      #  already output a property
+      my %DoneProps;
+
+      my $Props = $Card->{properties};
+
+      # Order the properties
+      my @PropKeys = sort {
+        ($PropOutputOrder{$a} // 1000) <=> ($PropOutputOrder{$b} // 1000)
+          || $a cmp $b
+      } keys %$Props;
+
+      # Make sure items in the same group are output together
+      my $Groups = $Card->{groups} || do {
+        my %Groups;
+        for (map { @$_ } values %$Props) {
+          push @{$Groups{$_->{group}}}, $_ if $_->{group};
+        }
+        \%Groups;
+      };
+
+      for my $PropKey (@PropKeys) {
+        my @PropVals = @{$Props->{$PropKey}};
+        for my $PropVal (@PropVals) {
+          next if $DoneProps{"$PropVal"}++;
 
-        push @OutputProps, $PropVal;
+          push @OutputProps, $PropVal;
 
-        # If it has a group, output all values in that group together
-        if (my $Group = $PropVal->{group}) {
-          push @OutputProps, grep { !$DoneProps{"$_"}++ } @{$Groups->{$Group}};
+          # If it has a group, output all values in that group together
+          if (my $Group = $PropVal->{group}) {
+            push @OutputProps, grep { !$DoneProps{"$_"}++ } @{$Groups->{$Group}};
+          }
         }
       }
     }
@@ -277,7 +347,9 @@ sub hash2vcardlines_pp {
       # rfc6350 3.3 - it is RECOMMENDED that property and parameter names be upper-case on output.
       my $Line = ($Group ? (uc $Group . ".") : "") . uc $LName;
 
-      while (my ($Param, $ParamVals) = each %{$_->{params} // {}}) {
+      # Tuples have a flat list of params in their original order
+      my @Params = $_->{paramlist} ? @{$_->{paramlist}} : %{$_->{params} // {}};
+      while (my ($Param, $ParamVals) = splice(@Params, 0, 2)) {
         if (!defined $ParamVals) {
           $Line .= ";" . uc($Param);
         }
@@ -358,6 +430,22 @@ sub foldline {
 
 # }}}
 
+package Text::VCardFast::LazyCard;
+
+# everything else is in the XS
+sub type { $_[0]{type} }
+
+# these hold C pointers which a new thread can't share, so it gets undef
+package Text::VCardFast::Card;
+
+sub CLONE_SKIP { 1 }
+
+package Text::VCardFast::Diff;
+
+sub CLONE_SKIP { 1 }
+
+package Text::VCardFast;
+
 1;
 
 1;
@@ -463,6 +551,111 @@ Wikipedia:
 
     default is barekeys off.
 
+  * recover - if set, a parse error doesn't abort the whole parse.
+    Instead the card containing the error is thrown away, parsing
+    resumes at the next line which opens a card of the same type, and
+    the returned hash gets an extra key 'errors' - an array of hashes
+    describing each skipped region:
+
+    {
+      code => 9,
+      error => 'End of line while parsing entry name',
+      startpos => 112, startline => 8, startchar => 1,
+      errorpos => 117, errorline => 8, errorchar => 5,
+      skipstart => 96,  # offset of the BEGIN line of the bad card
+      skipend => 130,   # offset where parsing resumed
+    }
+
+    The 'start' and 'error' positions are the same ones that would
+    have been reported in the error message without recover, except
+    for a card missing its END: that is reported from its BEGIN line
+    to the end of the skipped region, and once one has been seen a
+    card of the same type can no longer nest at the top level, so
+    each card after it is skipped on its own.  All offsets are in
+    bytes.  The 'errors' key is always present (maybe
+    empty) when recover is set.  Only supported by vcard2hash_c.
+
+    default is recover off.
+
+  * linenumbers - if set, every property hash gets an extra key 'line'
+    with the line number (counting from 1) where the property started
+    in the source.  Line numbers come from an index of newline
+    positions built once per parse, so they're cheap even for large
+    inputs.  Only supported by vcard2hash_c.
+
+    default is linenumbers off.
+
+  * lazy - if set, the cards in 'objects' are Text::VCardFast::LazyCard
+    objects instead of plain hashes.  They keep the parsed C tree alive
+    and only convert the parts you ask for into perl data, caching the
+    result.  See LAZY CARDS below.  Only supported by vcard2hash_c.
+
+    default is lazy off.
+
+  * cache - if set, the parsed data is kept in a cache inside the
+    module, keyed on a hash of the input and every option which affects
+    parsing.  Parsing the same input with the same options again only
+    has to convert the cached data to perl.  The cache is shared by all
+    callers in the process and least recently used entries are dropped
+    when it gets too large.  See CACHE below.  Only supported by
+    vcard2hash_c.
+
+    default is cache off.
+
+  * fingerprint - if set, each card gets a 'fingerprint' key: 32 hex
+    digits of a 128 bit hash of the card's parsed content, computed
+    while parsing.  Two cards with the same fingerprint have the same
+    properties, params, values and sub cards, regardless of line
+    folding, line endings, the order of properties or of params, and
+    the case of names.  The multival and multiparam options change what
+    gets parsed, so only compare fingerprints made with the same
+    options.  Only supported by vcard2hash_c.  Text::VCardFast::Card
+    objects also have a fingerprint method, and blob2hash takes this
+    option too.
+
+    default is fingerprint off.
+
+  * tuples - if set, each card is a hash of 'type' and 'entries' (plus
+    'objects' and 'fingerprint' as usual) rather than 'properties'.
+    'entries' is an array of the card's properties in their original
+    order, each one an array of [group, name, params, value].  group is
+    undef if there isn't one, params is a flat list of name, value
+    pairs in their original order (the value is undef for a bare param
+    with the barekeys option) or undef if there are none, and value is
+    an array for multival properties.  This uses around a third less
+    memory than the normal hashes, and hash2vcard writes tuple cards
+    back out in their original order.  The 'linenumbers' option doesn't
+    apply.  blob2hash also takes this option.
+
+    default is tuples off.
+
+  * structural - if set, the end of each run of plain characters is
+    found through a bitmap of the special characters, built a few
+    kilobytes ahead of the parser with AVX2 or SSE2, rather than by
+    scanning for each run's own stop characters.  The result is exactly
+    the same.  How much it helps depends on the CPU and the input, so
+    measure with your own data.  'sse2' or 'scalar' rather than a true
+    value force the slower ways of building the bitmap, for testing.
+
+    default is structural off.
+
+  * borrow - if set, values of a few hundred bytes or more which needed
+    no unescaping or unfolding point straight into a copy-on-write copy
+    of the input rather than being copied out, which makes big PHOTO
+    and KEY values nearly free.  Those values are read only; copy them
+    to change them.  Only the plain hash result borrows, with lazy,
+    cards or any of the other forms this does nothing.
+
+    default is borrow off.
+
+  * shared - if set, common parameter values like HOME, WORK, CELL and
+    PREF, common property names and the card type "vcard" are the same
+    read only scalar everywhere they occur, from a table built when the
+    module loads, rather than a new copy each time.  Other strings are
+    copied as usual.  Like borrow, only for the plain hash result.
+
+    default is shared off.
+
   The input is a scalar containing VFILE text, as per RFC 6350 or the various
   earlier RFCs it replaces.  If the perl unicode flag is set on the scalar,
   then it will be propagated to the output values.
@@ -494,6 +687,198 @@ Wikipedia:
   RFC says they are case insignificant - due to the increased complexity of
   tracking which version what parameters are in effect.
 
+=item LAZY CARDS
+
+  With the 'lazy' option, each card is a blessed hash which starts out
+  containing only 'type'.  The methods fill in the same keys a normal
+  card would have, so after calling them the object looks just like the
+  non-lazy result.
+
+  * $card->type - the card type.
+
+  * $card->property($name) - the array of property hashes for $name
+    (lowercase), or undef if there are none.  Only properties with that
+    name are converted.
+
+  * $card->properties - the full 'properties' hash.  Also stored in
+    $card->{properties}.
+
+  * $card->objects - an array of lazy sub cards.  Also stored in
+    $card->{objects}.
+
+  * $card->as_hash - a plain (non-lazy) copy of the whole card.
+
+  hash2vcard accepts lazy cards too.  Reading fields which haven't been
+  filled in yet straight out of the hash won't find them, so use the
+  methods.
+
+=item Text::VCard::vcard2cards($card, %options);
+
+  Parses like vcard2hash_c, with the same options, but returns a list of
+  Text::VCardFast::Card objects, one for each top level card.  These
+  never build the perl hash at all - every method answers straight from
+  the parsed C data, looking names up in a hash index of each card's
+  properties which is built while parsing.
+  Names can be given in any case, and as 'group.name' to only match
+  properties in that group.
+
+  * $card->type - the card type, lowercase.
+
+  * $card->get($name) - the value of the first property called $name
+    (an array reference for multival properties), or undef.
+
+  * $card->values($name) - the values of every property called $name.
+
+  * $card->param($name, $pname) - the values of parameter $pname on the
+    first property called $name only, as in the params hash of
+    vcard2hash, so bare params are values of 'type'.
+
+  * $card->names - the distinct property names, in the order they first
+    appear.
+
+  * $card->groups - the distinct groups, in the order they first appear.
+
+  * $card->objects - a list of Text::VCardFast::Card for the sub cards.
+
+  * $card->to_string($eol) - the card as VCARD text, with properties in
+    their original order.  Lines are separated with $eol, default "\n".
+
+  * $card->fingerprint - the card's fingerprint, as for the
+    'fingerprint' option.
+
+  * $card->as_hash - the card as a vcard2hash style hash.
+
+  * $card->diff($newcard) - what changed between two cards, as a
+    Text::VCardFast::Diff object.  Identical properties are paired up
+    first, then the remaining properties with the same name by how
+    similar their group, params and values are (a name which only has
+    one property on each side always pairs).  Whatever is left over was
+    added or removed.  Sub cards are not compared.
+
+  * $diff->changes - a list of hashes, one per change, with 'op' set to
+    'remove', 'add' or 'change', and 'old' and/or 'new' holding the
+    property in the same format as vcard2hash.  Removals come first,
+    then additions and changes in the order of the new card.
+
+  * $diff->apply($card) - a new Text::VCardFast::Card with the changes
+    applied to a copy of $card, which doesn't need to be the card the
+    diff was made from.  Changed properties stay where they were and
+    added ones go on the end.  Dies with "Patch does not apply to this
+    card" if a removed or changed property isn't in $card exactly.
+
+=item Text::VCard::vcard2blob($card, %options);
+
+  Parses like vcard2hash_c, with the same options, and returns the
+  parsed data in a compact binary format for caching.  The blob is
+  versioned, position independent and byte order independent, so it
+  can be stored anywhere and loaded on any platform.
+
+  Text::VCardFast::Card objects also have a to_blob method which
+  returns the same format for just that card.
+
+=item Text::VCard::blob2hash($blob, %options);
+
+  Loads a blob from vcard2blob or to_blob without parsing the text
+  again.  Returns the same hash vcard2hash would have, or with the
+  'lazy' or 'cards' options, lazy cards or Text::VCardFast::Card objects
+  as described above.  Dies if the blob is damaged or from an
+  unsupported version of the format.
+
+  The perl unicode flag of the original input is remembered in the blob.
+
+=item Text::VCard::vcard2canonical($card, %options);
+
+  Parses like vcard2hash_c, with the same options, and writes the cards
+  back out in a canonical form, so that cards which only differ in how
+  they were written come out byte for byte the same:
+
+  * names and param names uppercase
+  * params sorted by name and then value
+  * properties sorted by name, group and then the rest of the line,
+    except VERSION which stays first
+  * sub cards sorted by their canonical text
+  * values escaped, and param values quoted, only where needed
+  * lines folded at 75 octets and ending in CRLF
+
+  Top level cards stay in their original order.  The multival and
+  multiparam options affect escaping, so use the same ones every time.
+
+  Text::VCardFast::Card objects also have a to_canonical method which
+  returns the same for just that card.
+
+=item Text::VCard::vcard2jcard($card, %options);
+
+  Parses like vcard2hash_c, with the same options, and returns the cards
+  as jCard (RFC 7095) JSON, written straight from the parsed C data
+  without building any perl data.  The result is a JSON array with one
+  jCard per top level card, encoded as UTF-8 bytes if the input was.
+
+  Each property is [name, {params}, type, value].  The group goes in
+  the "group" param, repeated params become arrays, and multival
+  properties have an array value.  Sub cards are added as a third
+  element of their parent, the way jCal does components.
+
+  The value type is taken from the VALUE param if there is one.
+  Otherwise the 'types' option, a hash from lowercase property name to
+  type, is checked, and after that the defaults from RFC 6350 (uri for
+  PHOTO, URL and friends, date-and-or-time for BDAY and ANNIVERSARY,
+  timestamp for REV, and so on).  Anything else is text, or unknown for
+  X- properties.  integer and float values are written as JSON numbers.
+
+    my $json = vcard2jcard($data, multival => ['n', 'adr'],
+                           types => { tel => 'uri' });
+
+  Text::VCardFast::Card objects also have a to_jcard($types) method
+  which returns a single jCard.
+
+=item Text::VCard::vcard2json($card, %options);
+
+  Parses like vcard2hash_c, with the same options, and returns exactly
+  the structure vcard2hash_c would, including 'errors', 'line' and
+  'fingerprint' when asked for, but encoded as JSON by the C code
+  without making any perl data.  This is the format of the
+  t/cases/*.json files, and decode_json of the result is_deeply the
+  vcard2hash_c result.  Property names and params appear in the order
+  they are first seen in the card.  The JSON is UTF-8 encoded bytes
+  for unicode input.
+
+=item Text::VCard::jcard2hash($jcard, %options);
+
+  Reads jCard JSON, either a single jCard or an array of them, into the
+  same parsed data as vcard2hash_c would make from the equivalent VCARD
+  text, so it takes the same options and returns the same results:
+  plain hashes, 'lazy' or 'cards', 'blob', 'canonical', 'jcard' and
+  'fingerprint' all work.  Names are lowercased, the "group" param
+  becomes the group, array params are joined with commas unless they
+  are in the multiparam list, and structured values become multival
+  values for names in the multival list, or are joined with semicolons.
+  A VALUE param is added when the value type isn't the default which
+  vcard2jcard would have used, so jCard and text round trip apart from
+  VALUE params which only repeat the default.
+
+  The input is UTF-8 bytes or a perl unicode string, and values always
+  come back as unicode strings, like JSON::XS decode_json.  Invalid JSON dies
+  with "Invalid JSON", and JSON which isn't a jCard with "Not a valid
+  jCard", both with the position.
+
+=item Text::VCard::jcard2vcard($jcard, $eol, %options);
+
+  jCard to VCARD text in one call, written by the same C code as
+  Text::VCardFast::Card's to_string.  Lines end with $eol, default
+  "\n".
+
+=item CACHE
+
+  * Text::VCardFast::cache_size($bytes) - sets the approximate maximum
+    memory used by the cache (default 16MB), evicting entries if needed.
+    Returns the previous value.  With no argument, just returns the
+    current value.  A size of 0 disables the cache.
+
+  * Text::VCardFast::cache_clear() - drops everything in the cache.
+
+  * Text::VCardFast::cache_stats() - returns a hash of counters:
+    hits, misses, evictions, entries, bytes and max_bytes.
+
 =item Text::VCard::hash2vcard($hash, $eol)
 
   The inverse operation (as much as possible!)
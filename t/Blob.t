@@ -0,0 +1,74 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my @parseargs = (
+  multival => ['adr','org','n'],
+  multiparam => ['type'],
+);
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  my $hash = Text::VCardFast::vcard2hash_c($vdata, @parseargs);
+  my $blob = Text::VCardFast::vcard2blob($vdata, @parseargs);
+  is_deeply(Text::VCardFast::blob2hash($blob), $hash, "$test blob round trip");
+}
+
+{
+  my $vdata = getfile("$Bin/cases/unicode.vcf");
+  my $blob = Text::VCardFast::vcard2blob($vdata, @parseargs);
+  my $hash = Text::VCardFast::blob2hash($blob);
+  my ($value) = grep { utf8::is_utf8($_) } map { $_->[0]{value} // () } values %{$hash->{objects}[0]{properties}};
+  ok($value, "unicode flag kept");
+
+  my @cards = Text::VCardFast::vcard2cards($vdata, @parseargs);
+  my $one = Text::VCardFast::blob2hash($cards[0]->to_blob);
+  is_deeply($one, Text::VCardFast::vcard2hash_c($vdata, @parseargs), "card to_blob");
+
+  my $lazy = Text::VCardFast::blob2hash($blob, lazy => 1);
+  isa_ok($lazy->{objects}[0], 'Text::VCardFast::LazyCard');
+  is_deeply($lazy->{objects}[0]->as_hash, $hash->{objects}[0], "lazy from blob");
+
+  my $cards = Text::VCardFast::blob2hash($blob, cards => 1);
+  isa_ok($cards->{objects}[0], 'Text::VCardFast::Card');
+  is($cards->{objects}[0]->to_string, $cards[0]->to_string, "cards from blob");
+}
+
+{
+  my $blob = Text::VCardFast::vcard2blob("BEGIN:VCARD\nFN:x\nEND:VCARD\n");
+  eval { Text::VCardFast::blob2hash("junk") };
+  like($@, qr/Corrupt binary data/, "junk");
+  eval { Text::VCardFast::blob2hash(substr($blob, 0, -1)) };
+  like($@, qr/Corrupt binary data/, "truncated");
+  my $badversion = $blob;
+  substr($badversion, 4, 1, "\x63");
+  eval { Text::VCardFast::blob2hash($badversion) };
+  like($@, qr/Unsupported binary format version/, "version");
+
+  # a card which is its own child rather than the root's
+  my $loop = Text::VCardFast::vcard2blob("BEGIN:VCARD\nEND:VCARD\n");
+  substr($loop, 52, 4, pack('V', 0));
+  substr($loop, 72, 8, pack('VV', 1, 1));
+  eval { Text::VCardFast::blob2hash($loop) };
+  like($@, qr/Corrupt binary data/, "card linked to itself");
+
+  # every single byte corruption must be caught or load safely
+  for my $i (0..length($blob)-1) {
+    my $bad = $blob;
+    substr($bad, $i, 1, chr(ord(substr($bad, $i, 1)) ^ 0xff));
+    eval { Text::VCardFast::blob2hash($bad) };
+  }
+  pass("survived corrupt blobs");
+}
+
+done_testing();
@@ -0,0 +1,76 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use B;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my @args = (multival => ['n', 'adr'], multiparam => ['type']);
+
+my $photo = 'QUJD' x 1000;
+my $folded = join("\r\n ", ('RUZH' x 15) x 20);
+my $Card = "BEGIN:VCARD\r\nFN:Short\r\nPHOTO;ENCODING=b:$photo\r\n"
+         . "KEY;ENCODING=b:$folded\r\nNOTE:" . ('a\\,b' x 100) . "\r\n"
+         . "LOGO:" . ('z' x 300) . "\nEND:VCARD\r\n";
+
+sub borrowed { B::svref_2object(\$_[0])->LEN == 0 }
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, @args, borrow => 1);
+  is_deeply($hash, Text::VCardFast::vcard2hash_c($Card, @args), "same result");
+
+  my $props = $hash->{objects}[0]{properties};
+  ok(borrowed($props->{photo}[0]{value}), "big plain value borrowed");
+  ok(borrowed($props->{logo}[0]{value}), "value ending in a bare newline borrowed");
+  ok(!borrowed($props->{fn}[0]{value}), "small value copied");
+  ok(!borrowed($props->{key}[0]{value}), "folded value copied");
+  ok(!borrowed($props->{note}[0]{value}), "escaped value copied");
+
+  eval { $props->{photo}[0]{value} =~ s/Q/X/ };
+  like($@, qr/read-only/, "borrowed value is read only");
+
+  my $copy = $props->{photo}[0]{value};
+  $copy =~ s/Q/X/;
+  is(substr($copy, 0, 4), 'XUJD', "copies can be changed");
+  is(substr($props->{photo}[0]{value}, 0, 4), 'QUJD', "borrowed value unchanged");
+}
+
+{
+  my $src = $Card;
+  my $hash = Text::VCardFast::_vcard2hash($src, { @args, borrow => 1 });
+  my $item = $hash->{objects}[0]{properties}{photo}[0];
+  substr($src, index($src, 'QUJD'), 4, 'XXXX');
+  undef $src;
+  undef $hash;
+  ok(borrowed($item->{value}), "still borrowed");
+  is($item->{value}, $photo, "value outlives changes to the input and the input itself");
+}
+
+{
+  my $utf8 = "BEGIN:VCARD\nNOTE:" . ("J\x{f6}rg \x{263a} " x 100) . "\nEND:VCARD\n";
+  my $hash = Text::VCardFast::vcard2hash_c($utf8, borrow => 1);
+  ok(borrowed($hash->{objects}[0]{properties}{note}[0]{value}), "non-ASCII value borrowed");
+  is($hash->{objects}[0]{properties}{note}[0]{value}, "J\x{f6}rg \x{263a} " x 100, "and decoded");
+}
+
+{
+  # only the plain hash is streamed from the source
+  my $hash = Text::VCardFast::vcard2hash_c($Card, @args, borrow => 1, lazy => 1);
+  ok(!borrowed($hash->{objects}[0]->as_hash->{properties}{photo}[0]{value}), "lazy copies");
+}
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  is_deeply(Text::VCardFast::vcard2hash_c($vdata, @args, recover => 1, borrow => 1),
+            Text::VCardFast::vcard2hash_c($vdata, @args, recover => 1), "$test");
+}
+
+done_testing();
@@ -0,0 +1,71 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Test::More tests => 17;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+FN:Joe
+N:Bloggs;Joe;;;
+END:VCARD
+EOF
+
+my @args = (multival => ['n']);
+my $plain = Text::VCardFast::vcard2hash_c($Card, @args);
+
+{
+  my $stats = Text::VCardFast::cache_stats();
+  is($stats->{entries}, 0, "starts empty");
+}
+
+{
+  my $one = Text::VCardFast::vcard2hash_c($Card, @args, cache => 1);
+  my $two = Text::VCardFast::vcard2hash_c($Card, @args, cache => 1);
+  is_deeply($one, $plain, "first parse");
+  is_deeply($two, $plain, "cached parse");
+  isnt($one, $two, "separate perl data");
+
+  my $stats = Text::VCardFast::cache_stats();
+  is($stats->{hits}, 1, "one hit");
+  is($stats->{misses}, 1, "one miss");
+  is($stats->{entries}, 1, "one entry");
+}
+
+{
+  # different options are a different entry
+  my $hash = Text::VCardFast::vcard2hash_c($Card, cache => 1);
+  is($hash->{objects}[0]{properties}{n}[0]{value}, 'Bloggs;Joe;;;', "options in key");
+  my $lazy = Text::VCardFast::vcard2hash_c($Card, @args, cache => 1, lazy => 1);
+  is($lazy->{objects}[0]->property('fn')->[0]{value}, 'Joe', "lazy from cache");
+  my $stats = Text::VCardFast::cache_stats();
+  is($stats->{entries}, 2, "two entries");
+  is($stats->{hits}, 2, "lazy was a hit");
+}
+
+{
+  # the names of one list mustn't run into the next
+  my $card = "BEGIN:VCARD\nXV:1;2\nY:7;8\nEND:VCARD\n";
+  Text::VCardFast::vcard2hash_c($card, multival => ['x', 'vy'], cache => 1);
+  my $hash = Text::VCardFast::vcard2hash_c($card, multival => ['xv', 'y'], cache => 1);
+  is_deeply($hash->{objects}[0]{properties}{y}[0]{values}, ['7', '8'], "multival names kept apart");
+  is_deeply($hash->{objects}[0]{properties}{xv}[0]{values}, ['1', '2'], "both of them");
+}
+
+{
+  Text::VCardFast::cache_clear();
+  Text::VCardFast::cache_size(1000);
+  my $big = "BEGIN:VCARD\nNOTE:" . ("x" x 100) . "\nEND:VCARD\n";
+  Text::VCardFast::vcard2hash_c("$big\n" x $_, cache => 1) for 1..3;
+  my $stats = Text::VCardFast::cache_stats();
+  ok($stats->{bytes} <= 1000, "size limit kept");
+  ok($stats->{evictions} > 0, "evictions counted");
+
+  Text::VCardFast::cache_clear();
+  is(Text::VCardFast::cache_stats()->{entries}, 0, "cleared");
+}
@@ -0,0 +1,88 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+VERSION:3.0
+N:Bloggs;Joe;;;
+item1.EMAIL;type=pref;type=HOME:joe\@example.com
+FN:Joe Bloggs
+EMAIL;TYPE=WORK:joe\@example.org
+NOTE:a long note which goes on and on and on and on until it has to be folded
+BEGIN:VAGENT
+FN:Zed
+END:VAGENT
+BEGIN:VAGENT
+FN:Agent
+END:VAGENT
+END:VCARD
+EOF
+
+my $Other = join("\r\n",
+  "begin:vcard",
+  "fn:Joe Bloggs",
+  "BEGIN:VAGENT",
+  "FN:Agent",
+  "END:VAGENT",
+  "Note:a long note which goes on and on",
+  "  and on and on until it has to be folded",
+  "ITEM1.email;TYPE=\"HOME\";TYPE=pref:joe\@example.com",
+  "BEGIN:VAGENT",
+  "FN:Zed",
+  "END:VAGENT",
+  "email;type=WORK:joe\@example.org",
+  "n:Bloggs;Joe;;;",
+  "version:3.0",
+  "end:vcard", "");
+
+my $Expected = join("\r\n",
+  "BEGIN:VCARD",
+  "VERSION:3.0",
+  "EMAIL;TYPE=WORK:joe\@example.org",
+  "ITEM1.EMAIL;TYPE=HOME;TYPE=pref:joe\@example.com",
+  "FN:Joe Bloggs",
+  "N:Bloggs;Joe;;;",
+  "NOTE:a long note which goes on and on and on and on until it has to be fold",
+  " ed",
+  "BEGIN:VAGENT",
+  "FN:Agent",
+  "END:VAGENT",
+  "BEGIN:VAGENT",
+  "FN:Zed",
+  "END:VAGENT",
+  "END:VCARD", "");
+
+my @args = (multival => ['n'], multiparam => ['type']);
+
+my $canon = Text::VCardFast::vcard2canonical($Card, @args);
+is($canon, $Expected, "canonical form");
+is(Text::VCardFast::vcard2canonical($Other, @args), $canon, "same card written differently");
+is(Text::VCardFast::vcard2canonical($canon, @args), $canon, "stable");
+
+my ($card) = Text::VCardFast::vcard2cards($Card, @args);
+is($card->to_canonical, $canon, "card to_canonical");
+
+{
+  (my $two = $Card) =~ s/Joe Bloggs/Second/;
+  my $text = Text::VCardFast::vcard2canonical($two . $Card, @args);
+  like($text, qr/^BEGIN:VCARD\r\n.*FN:Second.*END:VCARD\r\nBEGIN:VCARD\r\n.*FN:Joe Bloggs/s, "top level order kept");
+}
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  my $text = Text::VCardFast::vcard2canonical($vdata, @args);
+  is(Text::VCardFast::vcard2canonical($text, @args), $text, "$test canonical is stable");
+}
+
+done_testing();
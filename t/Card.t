@@ -0,0 +1,76 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Test::More tests => 25;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+VERSION:3.0
+FN:Joe Bloggs
+N:Bloggs;Joe;;;
+ITEM1.EMAIL;TYPE=HOME;TYPE=PREF:joe\@example.com
+ITEM2.EMAIL;TYPE=WORK:joe\@example.org
+ITEM2.X-ABLABEL:Office
+NOTE:comma\\, semicolon\\; newline\\nand a long line which will need to be folded when it is written out
+LABEL;LABEL="1 Some St^nTown":x
+BEGIN:VAGENT
+FN:Agent
+END:VAGENT
+END:VCARD
+EOF
+
+my @args = (multival => ['n']);
+
+my @cards = Text::VCardFast::vcard2cards($Card, @args);
+is(scalar(@cards), 1, "one card");
+my $card = $cards[0];
+isa_ok($card, 'Text::VCardFast::Card');
+is($card->type, 'vcard', "type");
+is($card->get('fn'), 'Joe Bloggs', "get");
+is($card->get('FN'), 'Joe Bloggs', "get is case insensitive");
+is_deeply($card->get('n'), ['Bloggs', 'Joe', '', '', ''], "multival get");
+is_deeply([$card->values('email')], ['joe@example.com', 'joe@example.org'], "values");
+is_deeply([$card->values('item2.email')], ['joe@example.org'], "values in group");
+is_deeply([$card->param('email', 'type')], ['HOME', 'PREF'], "param");
+is_deeply([$card->param('item2.email', 'TYPE')], ['WORK'], "param in group");
+{
+  my $bare = "BEGIN:VCARD\nTEL;HOME;TYPE=CELL:1\nEND:VCARD\n";
+  foreach my $barekeys (0, 1) {
+    my ($c) = Text::VCardFast::vcard2cards($bare, barekeys => $barekeys);
+    my $hash = Text::VCardFast::vcard2hash_c($bare, barekeys => $barekeys);
+    is_deeply([$c->param('tel', 'type')], $hash->{objects}[0]{properties}{tel}[0]{params}{type},
+              "bare param matches the hash, barekeys $barekeys");
+  }
+}
+is($card->get('nosuch'), undef, "missing");
+is_deeply([$card->values('nosuch')], [], "missing values");
+is_deeply([$card->groups], ['item1', 'item2'], "groups");
+is_deeply([$card->names], [qw(version fn n email x-ablabel note label)], "names");
+
+my @objects = $card->objects;
+is($objects[0]->get('fn'), 'Agent', "sub card");
+
+my $hash = Text::VCardFast::vcard2hash_c($Card, @args);
+is_deeply($card->as_hash, $hash->{objects}[0], "as_hash");
+
+my $text = $card->to_string("\r\n");
+like($text, qr/^BEGIN:VCARD\r\nVERSION:3.0\r\n/, "to_string");
+is_deeply(Text::VCardFast::vcard2hash_c($text, @args), $hash, "to_string round trips");
+
+{
+  my $big = "BEGIN:VCARD\n" . join('', map { "X-FIELD$_:$_\n" } 1..500) . "X-FIELD7:again\nEND:VCARD\n";
+  my ($card) = Text::VCardFast::vcard2cards($big);
+  is($card->get('x-field250'), '250', "lookup in a large card");
+  is_deeply([$card->values('X-FIELD7')], ['7', 'again'], "repeated names in order");
+
+  my $blob = Text::VCardFast::vcard2blob($Card, @args);
+  my ($thawed) = @{Text::VCardFast::blob2hash($blob, cards => 1)->{objects}};
+  is_deeply([$thawed->values('item2.email')], ['joe@example.org'], "lookups on a thawed card");
+  is_deeply([$thawed->values('ITEM2.x-ablabel')], ['Office'], "group is case insensitive");
+}
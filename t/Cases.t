@@ -9,19 +9,14 @@ use strict;
 use warnings;
 use Encode qw(encode_utf8);
 use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
 use Test::More;
 use JSON::XS;
 
 BEGIN { use_ok('Text::VCardFast') };
 
-my @tests;
-if (opendir(DH, "$Bin/cases")) {
-    while (my $item = readdir(DH)) {
-	next unless $item =~ m/^(.*)\.vcf$/;
-	push @tests, $1;
-    }
-    closedir(DH);
-}
+my @tests = case_names();
 
 my $numtests = @tests;
 
@@ -66,6 +61,9 @@ foreach my $test (@tests) {
 	die "$jdata\n\n\n" . $coder->encode($chash);
     }
 
+    my $cjson = Text::VCardFast::vcard2json($vdata, @parseargs);
+    is_deeply(decode_json($cjson), $jhash, "vcard2json of $test.vcf matches $test.json");
+
     my $data = Text::VCardFast::hash2vcard($chash);
     my $rehash = Text::VCardFast::vcard2hash_c($data, @parseargs);
 
@@ -75,14 +73,5 @@ foreach my $test (@tests) {
     }
 }
 
-plan tests => ($numtests * 8) + 2;
-
-sub getfile {
-    my $file = shift;
-    open(FH, "<:encoding(UTF-8)", $file) or return;
-    local $/ = undef;
-    my $res = <FH>;
-    close(FH);
-    return $res;
-}
+plan tests => ($numtests * 9) + 2;
 
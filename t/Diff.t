@@ -0,0 +1,64 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Test::More tests => 14;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Old = <<EOF;
+BEGIN:VCARD
+FN:Joe Bloggs
+N:Bloggs;Joe;;;
+TEL;TYPE=CELL:+61 400 000 000
+TEL;TYPE=HOME:+61 3 9000 0000
+EMAIL;TYPE=HOME:joe\@example.com
+NOTE:gone soon
+END:VCARD
+EOF
+
+my $New = <<EOF;
+BEGIN:VCARD
+FN:Joseph Bloggs
+N:Bloggs;Joe;;;
+EMAIL;TYPE=HOME:joe\@example.com
+TEL;TYPE=HOME:+61 3 9000 0000
+TEL;TYPE=CELL:+61 400 111 111
+EMAIL;TYPE=WORK:joe\@example.org
+END:VCARD
+EOF
+
+my @args = (multival => ['n']);
+my ($old) = Text::VCardFast::vcard2cards($Old, @args);
+my ($new) = Text::VCardFast::vcard2cards($New, @args);
+
+my $diff = $old->diff($new);
+isa_ok($diff, 'Text::VCardFast::Diff');
+
+my @changes = $diff->changes;
+is(scalar(@changes), 4, "four changes");
+is_deeply([map { $_->{op} } @changes], [qw(remove change change add)], "ops in order");
+is($changes[0]{old}{value}, 'gone soon', "removed note");
+is($changes[1]{old}{value}, 'Joe Bloggs', "only fn pairs");
+is($changes[1]{new}{value}, 'Joseph Bloggs', "new fn");
+is($changes[2]{old}{value}, '+61 400 000 000', "cell paired by type");
+is($changes[2]{new}{value}, '+61 400 111 111', "new cell");
+is($changes[3]{new}{params}{type}[0], 'WORK', "added email");
+
+my @none = $old->diff($old)->changes;
+is(scalar(@none), 0, "no changes to itself");
+
+{
+  my $patched = $diff->apply($old);
+  isa_ok($patched, 'Text::VCardFast::Card');
+  is($patched->to_canonical, $new->to_canonical, "patch gives the new card");
+}
+
+{
+  my ($other) = Text::VCardFast::vcard2cards("BEGIN:VCARD\nFN:Someone\nEND:VCARD\n");
+  eval { $diff->apply($other) };
+  like($@, qr/Patch does not apply/, "conflict");
+}
@@ -0,0 +1,85 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Test::More tests => 13;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+FN:Joe Bloggs
+N:Bloggs;Joe;;;
+EMAIL;TYPE=HOME;PREF=1:joe\@example.com
+NOTE:a long note which is folded
+BEGIN:VAGENT
+FN:Agent
+END:VAGENT
+END:VCARD
+EOF
+
+my $Reordered = join("\r\n",
+  "begin:vcard",
+  "note:a long note ",
+  " which is folded",
+  "Email;pref=1;type=HOME:joe\@example.com",
+  "n:Bloggs;Joe;;;",
+  "BEGIN:VAGENT",
+  "FN:Agent",
+  "END:VAGENT",
+  "Fn:Joe Bloggs",
+  "end:vcard", "");
+
+my @args = (multival => ['n'], fingerprint => 1);
+
+sub fp {
+  my $hash = Text::VCardFast::vcard2hash_c(shift, @args);
+  return $hash->{objects}[0]{fingerprint};
+}
+
+my $fp = fp($Card);
+like($fp, qr/^[0-9a-f]{32}$/, "hex fingerprint");
+is(fp($Reordered), $fp, "order, folding, endings and case ignored");
+
+(my $changed = $Card) =~ s/joe\@example.com/jo\@example.com/;
+isnt(fp($changed), $fp, "value change");
+(my $param = $Card) =~ s/PREF=1/PREF=2/;
+isnt(fp($param), $fp, "param change");
+(my $sub = $Card) =~ s/FN:Agent/FN:Other/;
+isnt(fp($sub), $fp, "sub card change");
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, multival => ['n']);
+  ok(!exists $hash->{objects}[0]{fingerprint}, "no fingerprint without option");
+}
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, @args, lazy => 1);
+  is($hash->{objects}[0]{fingerprint}, $fp, "lazy card");
+}
+
+{
+  my ($card) = Text::VCardFast::vcard2cards($Card, multival => ['n']);
+  is($card->fingerprint, $fp, "card handle");
+}
+
+{
+  # the handle's doc is the cached one, asking it doesn't add to output
+  Text::VCardFast::cache_clear();
+  my ($card) = Text::VCardFast::vcard2cards($Card, multival => ['n'], cache => 1);
+  is($card->fingerprint, $fp, "cached card handle");
+  my $hash = Text::VCardFast::vcard2hash_c($Card, multival => ['n'], cache => 1, lazy => 1);
+  ok(!exists $hash->{objects}[0]{fingerprint}, "not in a later parse from the cache");
+  Text::VCardFast::cache_clear();
+}
+
+{
+  my $blob = Text::VCardFast::vcard2blob($Card, multival => ['n']);
+  my $hash = Text::VCardFast::blob2hash($blob, fingerprint => 1);
+  is($hash->{objects}[0]{fingerprint}, $fp, "from blob");
+  my $plain = Text::VCardFast::vcard2hash_c($Card, @args);
+  is_deeply($hash, $plain, "blob matches parse");
+}
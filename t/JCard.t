@@ -0,0 +1,126 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use JSON::XS;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+VERSION:4.0
+FN:Joe "The Hat" Bloggs
+N:Bloggs;Joe;;;
+ITEM1.EMAIL;TYPE=HOME;TYPE=PREF:joe\@example.com
+TEL;VALUE=uri:tel:+61-3-9000-0000
+PHOTO:http://example.com/joe.jpg
+BDAY:19700101
+X-COUNT;VALUE=integer:42
+X-THING:stuff
+NOTE:line one\\nline two
+END:VCARD
+EOF
+
+my @args = (multival => ['n'], multiparam => ['type']);
+
+my $json = Text::VCardFast::vcard2jcard($Card, @args);
+my $data = decode_json($json);
+is(ref($data), 'ARRAY', "array of cards");
+my ($vcard, $props) = @{$data->[0]};
+is($vcard, 'vcard', "card type");
+
+my %p = map { $_->[0] => $_ } @$props;
+is_deeply($p{version}, ['version', {}, 'text', '4.0'], "version");
+is_deeply($p{fn}, ['fn', {}, 'text', 'Joe "The Hat" Bloggs'], "quotes escaped");
+is_deeply($p{n}, ['n', {}, 'text', ['Bloggs', 'Joe', '', '', '']], "structured value");
+is_deeply($p{email}, ['email', {group => 'item1', type => ['HOME', 'PREF']}, 'text', 'joe@example.com'], "group and params");
+is_deeply($p{tel}, ['tel', {}, 'uri', 'tel:+61-3-9000-0000'], "VALUE param");
+is($p{photo}[2], 'uri', "default uri");
+is($p{bday}[2], 'date-and-or-time', "default date");
+is($p{'x-thing'}[2], 'unknown', "unknown extension");
+is($p{note}[3], "line one\nline two", "newline");
+like($json, qr/\["x-count",\{\},"integer",42\]/, "integer as number");
+
+{
+  my $typed = decode_json(Text::VCardFast::vcard2jcard($Card, @args, types => { photo => 'text', 'x-thing' => 'text' }));
+  my %t = map { $_->[0] => $_ } @{$typed->[0][1]};
+  is($t{photo}[2], 'text', "types option");
+  is($t{'x-thing'}[2], 'text', "types option for extension");
+  is($t{tel}[2], 'uri', "VALUE param wins");
+}
+
+{
+  my ($card) = Text::VCardFast::vcard2cards($Card, @args);
+  is_deeply(decode_json($card->to_jcard), $data->[0], "to_jcard");
+}
+
+{
+  my $sub = decode_json(Text::VCardFast::vcard2jcard("BEGIN:VCARD\nFN:a\nBEGIN:VAGENT\nFN:b\nEND:VAGENT\nEND:VCARD\n"));
+  is_deeply($sub, [['vcard', [['fn', {}, 'text', 'a']], [['vagent', [['fn', {}, 'text', 'b']]]]]], "sub cards");
+}
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  my $hash = Text::VCardFast::vcard2hash_c($vdata, @args);
+  my $jcard = eval { decode_json(Text::VCardFast::vcard2jcard($vdata, @args)) };
+  is(scalar(@{$jcard || []}), scalar(@{$hash->{objects}}), "$test is valid JSON");
+  my $back = Text::VCardFast::jcard2hash(Text::VCardFast::vcard2jcard($vdata, @args), @args);
+  # VALUE params are only kept where they aren't the default type
+  is_deeply(novalue($back), novalue($hash), "$test round trips through jCard");
+}
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, @args, fingerprint => 1);
+  my $back = Text::VCardFast::jcard2hash($json, @args, fingerprint => 1);
+  is_deeply($back, $hash, "jcard2hash");
+  is($back->{objects}[0]{properties}{tel}[0]{params}{value}[0], 'uri', "VALUE param kept");
+  ok(!exists $back->{objects}[0]{properties}{photo}[0]{params}{value}, "no VALUE for defaults");
+
+  my $text = Text::VCardFast::jcard2vcard($json, "\r\n", @args);
+  like($text, qr/^BEGIN:VCARD\r\nVERSION:4.0\r\n/, "jcard2vcard");
+  is_deeply(Text::VCardFast::vcard2hash_c($text, @args), Text::VCardFast::vcard2hash_c($Card, @args), "jcard2vcard round trips");
+
+  my ($card) = Text::VCardFast::jcard2hash(encode_json($data->[0]), @args, cards => 1)->{objects}[0];
+  is($card->get('fn'), 'Joe "The Hat" Bloggs', "single jCard to card handle");
+}
+
+{
+  my $unicode = decode_json(encode_json(["vcard", [["fn", {}, "text", "J\x{f6}rg \x{1F600}"]]]));
+  my $hash = Text::VCardFast::jcard2hash(encode_json($unicode));
+  is($hash->{objects}[0]{properties}{fn}[0]{value}, "J\x{f6}rg \x{1F600}", "decoded as UTF-8");
+  my $escaped = Text::VCardFast::jcard2hash('["vcard",[["fn",{},"text","J\\u00f6rg \\ud83d\\ude00"]]]');
+  is_deeply($escaped, $hash, "unicode escapes and surrogates");
+}
+
+{
+  eval { Text::VCardFast::jcard2hash('["vcard", [["fn", {}, "text", "x"]]') };
+  like($@, qr/Invalid JSON at line 1/, "bad JSON");
+  eval { Text::VCardFast::jcard2hash('["vcard", [["fn", "text", "x"]]]') };
+  like($@, qr/Not a valid jCard/, "bad jCard");
+  eval { Text::VCardFast::jcard2hash(("[" x 100) . ("]" x 100)) };
+  like($@, qr/Invalid JSON/, "nesting limit");
+  eval { Text::VCardFast::jcard2hash(qq{["vcard", [["fn", {}, "text", "tab\there"]]]}) };
+  like($@, qr/Invalid JSON/, "raw control character in a string");
+  eval { Text::VCardFast::jcard2hash('["vcard", [["fn", {}, "text", "nul\\u0000here"]]]') };
+  like($@, qr/Invalid JSON/, "escaped NUL in a string");
+}
+
+done_testing();
+
+sub novalue {
+  my $hash = shift;
+  foreach my $card (@{$hash->{objects}}) {
+    foreach my $props (values %{$card->{properties}}) {
+      delete $_->{params}{value} for @$props;
+    }
+    novalue($card);
+  }
+  return $hash;
+}
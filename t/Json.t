@@ -0,0 +1,38 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use JSON::XS;
+use Test::More tests => 6;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+FN:Joe "Quote" Bloggs \x{263a}
+NOTE:tab\there\\nnewline\\\\
+EMAIL;TYPE=HOME;PREF:joe\@example.com
+EMAIL:joe\@example.org
+X-EMPTY;X-P=:
+BEGIN:VAGENT
+FN:Agent
+END:VAGENT
+END:VCARD
+BEGIN:VCARD
+BROKEN
+END:VCARD
+EOF
+
+my @args = (multiparam => ['type'], recover => 1, linenumbers => 1, fingerprint => 1);
+
+my $hash = Text::VCardFast::vcard2hash_c($Card, @args);
+my $json = Text::VCardFast::vcard2json($Card, @args);
+ok(!utf8::is_utf8($json), "encoded bytes");
+is_deeply(decode_json($json), $hash, "same as vcard2hash_c");
+is(scalar(@{$hash->{errors}}), 1, "errors included");
+is(decode_json($json)->{objects}[0]{properties}{fn}[0]{line}, 2, "line numbers");
+
+is_deeply(decode_json(Text::VCardFast::vcard2json("")), {}, "empty");
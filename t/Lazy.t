@@ -0,0 +1,63 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Test::More tests => 15;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+FN:Joe
+EMAIL;TYPE=HOME:joe\@example.com
+EMAIL;TYPE=WORK:joe\@example.org
+N:Bloggs;Joe;;;
+BEGIN:VAGENT
+FN:Agent
+END:VAGENT
+END:VCARD
+EOF
+
+my @args = (multival => ['n']);
+my $eager = Text::VCardFast::vcard2hash_c($Card, @args);
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, @args, lazy => 1);
+  my $card = $hash->{objects}[0];
+  isa_ok($card, 'Text::VCardFast::LazyCard');
+  is($card->type, 'vcard', "type");
+  ok(!exists $card->{properties}, "nothing converted yet");
+
+  my $emails = $card->property('email');
+  is_deeply($emails, $eager->{objects}[0]{properties}{email}, "emails");
+  is($card->property('email'), $emails, "cached");
+  is($card->property('nosuch'), undef, "missing property");
+  is_deeply([sort keys %$card], ['type'], "nothing private in the hash");
+
+  my $props = $card->properties;
+  is_deeply($props, $eager->{objects}[0]{properties}, "all properties");
+  is($props->{email}, $emails, "reuses converted property");
+  is($card->{properties}, $props, "stored in the hash");
+
+  my $objects = $card->objects;
+  is($objects->[0]->property('fn')->[0]{value}, 'Agent', "sub card");
+
+  is_deeply($card->as_hash, $eager->{objects}[0], "as_hash");
+}
+
+{
+  # sub cards outlive everything else
+  my $hash = Text::VCardFast::vcard2hash_c($Card, @args, lazy => 1);
+  my $sub = $hash->{objects}[0]->objects->[0];
+  undef $hash;
+  is($sub->property('fn')->[0]{value}, 'Agent', "tree kept alive");
+}
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, @args, lazy => 1);
+  my $text = Text::VCardFast::hash2vcard($hash);
+  is_deeply(Text::VCardFast::vcard2hash_c($text, @args), $eager, "hash2vcard on lazy cards");
+}
@@ -0,0 +1,47 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Test::More tests => 7;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+
+FN:one
+NOTE:a long note
+  folded over
+EMAIL;TYPE=HOME:one\@example.com
+END:VCARD
+BEGIN:VCARD
+FN:two
+BAD
+END:VCARD
+EOF
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, only_one => 1, linenumbers => 1);
+  my $props = $hash->{objects}[0]{properties};
+  is($props->{fn}[0]{line}, 3, "fn line");
+  is($props->{note}[0]{line}, 4, "note line");
+  is($props->{email}[0]{line}, 6, "line after fold");
+}
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, only_one => 1);
+  ok(!exists $hash->{objects}[0]{properties}{fn}[0]{line}, "no line without option");
+}
+
+{
+  my $hash = eval { Text::VCardFast::vcard2hash_c($Card) };
+  like($@, qr/at line 10 char 3/, "error position");
+}
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Card, recover => 1);
+  is($hash->{errors}[0]{errorline}, 10, "recovered error position");
+}
@@ -0,0 +1,96 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Test::More tests => 27;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Cards = <<EOF;
+BEGIN:VCARD
+FN:one
+END:VCARD
+BEGIN:VCARD
+FN:two
+BROKEN
+END:VCARD
+BEGIN:VCARD
+FN:three
+END:VCARD
+BEGIN:VCARD
+FN:four
+BEGIN:VCARD
+FN:five
+END:VCARD
+EOF
+
+{
+  my $hash = eval { Text::VCardFast::vcard2hash_c($Cards) };
+  like($@, qr/End of line while parsing entry name/, "dies without recover");
+}
+
+{
+  my $hash = eval { Text::VCardFast::vcard2hash_c($Cards, recover => 1) };
+  is($@, '', "no error with recover");
+  my @fn = map { $_->{properties}{fn}[0]{value} } @{$hash->{objects}};
+  is_deeply(\@fn, ['one', 'three', 'five'], "good cards kept");
+
+  my $errors = $hash->{errors};
+  is(scalar(@$errors), 2, "two errors");
+  like($errors->[0]{error}, qr/End of line while parsing entry name/, "first error");
+  is($errors->[0]{errorline}, 6, "first error line");
+  is(substr($Cards, $errors->[0]{skipstart}, 17), "BEGIN:VCARD\nFN:tw", "first skip start");
+  is(substr($Cards, $errors->[0]{skipend}, 20), "BEGIN:VCARD\nFN:three", "first skip end");
+  like($errors->[1]{error}, qr/not completed/, "second error");
+  is(substr($Cards, $errors->[1]{skipstart}, 19), "BEGIN:VCARD\nFN:four", "second skip start");
+  is(substr($Cards, $errors->[1]{skipend}, 19), "BEGIN:VCARD\nFN:five", "second skip end");
+}
+
+{
+  my $hash = eval { Text::VCardFast::vcard2hash_c("junk\nBEGIN:VCARD\nFN:x\nEND:VCARD\n", recover => 1) };
+  is($@, '', "junk before card");
+  is($hash->{objects}[0]{properties}{fn}[0]{value}, 'x', "card after junk");
+  is(scalar(@{$hash->{errors}}), 1, "junk reported");
+}
+
+{
+  my $hash = eval { Text::VCardFast::vcard2hash_c("BEGIN:VCARD\nFN:x\nEND:VCARD\n", recover => 1) };
+  is_deeply($hash->{errors}, [], "no errors on clean input");
+  is($hash->{objects}[0]{properties}{fn}[0]{value}, 'x', "clean card");
+}
+
+{
+  # each lost END makes the cards after it nest, but every one of them
+  # should be skipped just once and blamed for its own lines
+  my $src = "BEGIN:VCARD\nFN:a\nBEGIN:VCARD\nFN:b\nBEGIN:VCARD\nFN:c\n"
+          . "BEGIN:VCARD\nFN:d\nEND:VCARD\n";
+  my $hash = eval { Text::VCardFast::vcard2hash_c($src, recover => 1) };
+  is($@, '', "lost ENDs recover");
+  my @fn = map { $_->{properties}{fn}[0]{value} } @{$hash->{objects}};
+  is_deeply(\@fn, ['d'], "card after the lost ENDs kept");
+
+  my $errors = $hash->{errors};
+  is(scalar(@$errors), 3, "one error per lost END");
+  is_deeply([map { substr($src, $_->{skipstart}, 16) } @$errors],
+            ["BEGIN:VCARD\nFN:a", "BEGIN:VCARD\nFN:b", "BEGIN:VCARD\nFN:c"],
+            "each skip starts at its own card");
+  is_deeply([map { $_->{skipend} } @$errors],
+            [map { $_->{skipstart} } @$errors[1,2], { skipstart => index($src, "BEGIN:VCARD\nFN:d") }],
+            "each skip ends at the next card");
+  is_deeply([map { $_->{startpos} } @$errors], [map { $_->{skipstart} } @$errors],
+            "start positions are the cards");
+  is_deeply([map { $_->{errorline} } @$errors], [2, 4, 6], "error lines are in the cards");
+  is(scalar(grep { $_->{errorpos} < $_->{skipstart} || $_->{errorpos} >= $_->{skipend} } @$errors),
+     0, "error positions are in the skipped regions");
+}
+
+{
+  my $src = "BEGIN:VCARD\nFN:a\nBEGIN:VCARD\nFN:b\nEND:VCARD\nEND:VCARD\n"
+          . "BEGIN:VCARD\nFN:c\n";
+  my $hash = eval { Text::VCardFast::vcard2hash_c($src, recover => 1) };
+  is(scalar(@{$hash->{objects}[0]{objects}}), 1, "nesting before a lost END kept");
+  is(scalar(@{$hash->{errors}}), 1, "only the lost END reported");
+}
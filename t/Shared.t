@@ -0,0 +1,63 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my @args = (multival => ['n', 'adr'], multiparam => ['type']);
+
+my $Cards = <<EOF;
+BEGIN:VCARD
+FN:One
+TEL;TYPE=HOME,VOICE:1
+EMAIL;TYPE=INTERNET;TYPE=HOME:one\@example.com
+END:VCARD
+BEGIN:VCARD
+FN:Two
+TEL;TYPE=home:2
+TEL;CELL:3
+X-THING;TYPE=UNCOMMON:4
+END:VCARD
+EOF
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c($Cards, @args, shared => 1);
+  is_deeply($hash, Text::VCardFast::vcard2hash_c($Cards, @args), "same result");
+
+  my ($one, $two) = @{$hash->{objects}};
+  ok(\$one->{type} == \$two->{type}, "card types shared");
+  ok(\$one->{properties}{tel}[0]{params}{type}[0] == \$one->{properties}{email}[0]{params}{type}[1],
+     "parameter values shared");
+  ok(\$one->{properties}{fn}[0]{name} == \$two->{properties}{fn}[0]{name}, "names shared");
+  ok(\$two->{properties}{tel}[0]{params}{type}[0] != \$one->{properties}{tel}[0]{params}{type}[0],
+     "case matters");
+  is($two->{properties}{tel}[1]{params}{type}[0], 'CELL', "bare parameters shared too");
+
+  eval { $one->{type} = 'vcalendar' };
+  like($@, qr/read-only/, "shared values are read only");
+  eval { $two->{properties}{'x-thing'}[0]{params}{type}[0] = 'common' };
+  is($@, '', "others aren't");
+}
+
+{
+  my $hash = Text::VCardFast::vcard2hash_c("BEGIN:VCARD\nFN:J\x{263a}rg\nTEL;TYPE=HOME:1\nEND:VCARD\n", shared => 1);
+  ok(utf8::is_utf8($hash->{objects}[0]{properties}{tel}[0]{params}{type}[0]), "character strings for character input");
+  my $bytes = Text::VCardFast::vcard2hash_c("BEGIN:VCARD\nFN:Joe\nTEL;TYPE=HOME:1\nEND:VCARD\n", shared => 1);
+  ok(!utf8::is_utf8($bytes->{objects}[0]{properties}{tel}[0]{params}{type}[0]), "byte strings for byte input");
+}
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  is_deeply(Text::VCardFast::vcard2hash_c($vdata, @args, recover => 1, shared => 1),
+            Text::VCardFast::vcard2hash_c($vdata, @args, recover => 1), "$test");
+}
+
+done_testing();
@@ -0,0 +1,80 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+# a plain hash is streamed from the parser, the cache still goes
+# through a tree, so the two must always agree
+sub check {
+  my ($vdata, $name, @args) = @_;
+  Text::VCardFast::cache_clear();
+  my $tree = eval { Text::VCardFast::vcard2hash_c($vdata, @args, cache => 1) };
+  my $treeerr = $@;
+  my $stream = eval { Text::VCardFast::vcard2hash_c($vdata, @args) };
+  is($@, $treeerr, "$name: same error");
+  is_deeply($stream, $tree, "$name: same result");
+}
+
+my @args = (multival => ['n', 'adr'], multiparam => ['type']);
+
+my $Nested = <<EOF;
+BEGIN:VCARD
+FN:outer
+BEGIN:VCARD
+FN:inner
+BEGIN:VCARD
+FN:innermost
+END:VCARD
+END:VCARD
+NOTE:after
+END:VCARD
+EOF
+
+my $Broken = <<EOF;
+BEGIN:VCARD
+FN:one
+END:VCARD
+BEGIN:VCARD
+FN:two
+BEGIN:VCARD
+FN:nested
+BROKEN
+END:VCARD
+END:VCARD
+BEGIN:VCARD
+FN:three
+END:VCARD
+EOF
+
+check($Nested, "nested", @args);
+check($Nested, "nested fingerprints", @args, fingerprint => 1);
+check($Nested, "nested lines", @args, linenumbers => 1);
+check($Broken, "broken dies", @args);
+check($Broken, "broken recovers", @args, recover => 1, fingerprint => 1);
+check("FN:stray\n$Nested", "stray entry recovers", @args, recover => 1);
+check("BEGIN:VCARD\nFN:bad\nBROKEN\nEND:VCARD\n", "nothing left", recover => 1);
+check("BEGIN:VCARD\nFN:a\nBEGIN:VCARD\nFN:b\n$Nested", "lost ENDs recover", @args, recover => 1);
+check("$Nested$Nested", "only one", @args, only_one => 1);
+
+{
+  # values bigger than an arena chunk, in every card
+  my $big = join('', map { "BEGIN:VCARD\nFN:$_\nPHOTO:" . ('x' x (5000 * $_)) . "\nEND:VCARD\n" } 1..20);
+  check($big, "big values", @args);
+  check("$big$Broken$big", "big values recover", @args, recover => 1);
+}
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  check($vdata, $test, @args, fingerprint => 1, linenumbers => 1, recover => 1);
+}
+
+done_testing();
@@ -0,0 +1,50 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my @args = (multival => ['n', 'adr'], multiparam => ['type']);
+
+# the best the CPU has, then each fallback
+foreach my $how (1, 'sse2', 'scalar') {
+  # specials either side of every 64 byte block and 4k window boundary
+  foreach my $pad (0..3, 60..68, 4090..4100) {
+    my $card = "BEGIN:VCARD\r\nFN:" . ('x' x $pad) . "\\,y\r\n"
+             . "NOTE;X-P=\"a^'b\":" . ('z' x $pad) . "\\n;\r\n " . ('w' x $pad) . "\r\n"
+             . "N:" . ('n' x $pad) . ";b\\;c;;;\r\nEND:VCARD\r\n";
+    is_deeply(Text::VCardFast::vcard2hash_c($card, @args, structural => $how),
+              Text::VCardFast::vcard2hash_c($card, @args), "$how: padding $pad");
+  }
+
+  my $big = "BEGIN:VCARD\nPHOTO;ENCODING=b:" . ('QUJD' x 50000) . "\nEND:VCARD";
+  is_deeply(Text::VCardFast::vcard2hash_c($big, structural => $how),
+            Text::VCardFast::vcard2hash_c($big), "$how: long value without a final newline");
+  my $utf8 = "BEGIN:VCARD\nFN:" . ("J\x{f6}rg \x{263a} " x 1000) . "\nEND:VCARD\n";
+  is_deeply(Text::VCardFast::vcard2hash_c($utf8, structural => $how),
+            Text::VCardFast::vcard2hash_c($utf8), "$how: non-ASCII");
+}
+
+{
+  my $bad = "BEGIN:VCARD\nFN:a\nBROKEN\nEND:VCARD\n";
+  eval { Text::VCardFast::vcard2hash_c($bad, structural => 1) };
+  like($@, qr/End of line while parsing entry name at line 3/, "errors as usual");
+}
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  foreach my $how (1, 'sse2', 'scalar') {
+    is_deeply(Text::VCardFast::vcard2hash_c($vdata, @args, structural => $how),
+              Text::VCardFast::vcard2hash_c($vdata, @args), "$how: $test");
+  }
+}
+
+done_testing();
@@ -0,0 +1,110 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use Config;
+BEGIN {
+  unless ($Config{useithreads}) {
+    print "1..0 # SKIP no ithreads\n";
+    exit 0;
+  }
+}
+use threads;
+use threads::shared;
+
+use FindBin qw($Bin);
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my @args = (multival => ['n', 'adr'], multiparam => ['type']);
+
+my $Cards = join('', map { "BEGIN:VCARD\nFN:Person $_\nTEL;TYPE=HOME:$_\nNOTE:" . ('x' x (100 * $_)) . "\nEND:VCARD\n" } 1..50);
+my $expect = Text::VCardFast::vcard2hash_c($Cards, @args);
+
+{
+  # every thread has its own parser pool and shared strings
+  my @threads = map {
+    threads->create(sub {
+      my $ok = 1;
+      for (1..20) {
+        my $hash = Text::VCardFast::vcard2hash_c($Cards, @args, shared => 1, borrow => 1);
+        $ok = 0 unless $hash->{objects}[49]{properties}{fn}[0]{value} eq 'Person 50'
+                   and $hash->{objects}[0]{properties}{tel}[0]{params}{type}[0] eq 'HOME';
+      }
+      return $ok;
+    })
+  } 1..4;
+  is_deeply([map { $_->join } @threads], [1, 1, 1, 1], "parallel parses");
+}
+
+{
+  Text::VCardFast::cache_clear();
+  Text::VCardFast::cache_size(1024 * 1024);
+  Text::VCardFast::vcard2hash_c($Cards, @args, cache => 1);
+  my $stats = threads->create(sub {
+    my $before = Text::VCardFast::cache_stats();
+    Text::VCardFast::vcard2hash_c($Cards, @args, cache => 1);
+    Text::VCardFast::cache_clear();
+    return [$before->{entries}, $before->{max_bytes}];
+  })->join;
+  is_deeply($stats, [0, 1024 * 1024], "a new thread starts with an empty cache of the same size");
+  is(Text::VCardFast::cache_stats()->{entries}, 1, "and leaves ours alone");
+  Text::VCardFast::cache_clear();
+}
+
+{
+  # lazy cards share their tree with the new thread
+  my $lazy = Text::VCardFast::vcard2hash_c($Cards, @args, lazy => 1, cache => 1);
+  my $card = Text::VCardFast::vcard2hash_c($Cards, @args, cards => 1)->{objects}[0];
+  # converted already, so the private cache goes to the thread too
+  $lazy->{objects}[2]->property('tel');
+  my $res = threads->create(sub {
+    my $hash = $lazy->{objects}[2]->as_hash;
+    undef $lazy;
+    return [$hash, ref($card) eq "SCALAR" && !defined $$card ? 1 : 0];
+  })->join;
+  is_deeply($res->[0], $expect->{objects}[2], "lazy card used in a thread");
+  is($res->[1], 1, "card handles come through as undef");
+  is_deeply($lazy->{objects}[3]->as_hash, $expect->{objects}[3], "and still here");
+  undef $lazy;
+  Text::VCardFast::cache_clear();
+}
+
+{
+  # borrowed values point into the source, which the new thread copies
+  my $photo = 'QUJD' x 1000;
+  my $src = "BEGIN:VCARD\nPHOTO:$photo\nEND:VCARD\n";
+  my $hash = Text::VCardFast::vcard2hash_c($src, borrow => 1);
+  my $freed :shared = 0;
+  my $thr = threads->create(sub {
+    lock($freed);
+    cond_wait($freed) until $freed;
+    return $hash->{objects}[0]{properties}{photo}[0]{value};
+  });
+  undef $hash;
+  undef $src;
+  # the last match in vcard2hash_c keeps a copy of the source too
+  Text::VCardFast::vcard2hash_c("BEGIN:VCARD\nFN:x\nEND:VCARD\n");
+  my @junk = map { 'x' x $_ } 3900..4200;
+  { lock($freed); $freed = 1; cond_signal($freed); }
+  is($thr->join, $photo, "borrowed value used in a thread after ours is freed");
+}
+
+SKIP: {
+  skip "no fork", 1 unless $Config{d_fork};
+  my $lazy = Text::VCardFast::vcard2hash_c($Cards, @args, lazy => 1);
+  my $pid = fork();
+  if (!$pid) {
+    my $ok = $lazy->{objects}[1]->as_hash->{properties}{fn}[0]{value} eq 'Person 2'
+         && Text::VCardFast::vcard2hash_c($Cards, @args)->{objects}[4]{properties}{fn}[0]{value} eq 'Person 5';
+    exit($ok ? 0 : 1);
+  }
+  waitpid($pid, 0);
+  is($?, 0, "parses after fork");
+}
+
+done_testing();
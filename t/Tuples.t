@@ -0,0 +1,76 @@
+# Before `make install' is performed this script should be runnable with
+# `make test'. After `make install' it should work as `perl Text-VCardFast.t'
+
+#########################
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use CaseFiles;
+use Test::More;
+BEGIN { use_ok('Text::VCardFast') };
+
+my $Card = <<EOF;
+BEGIN:VCARD
+VERSION:3.0
+N:Bloggs;Joe;;;
+ITEM1.EMAIL;TYPE=HOME;TYPE=PREF:joe\@example.com
+FN:Joe Bloggs
+X-FLAG;BARE:yes
+BEGIN:VAGENT
+FN:Agent
+END:VAGENT
+END:VCARD
+EOF
+
+my @args = (multival => ['n'], multiparam => ['type']);
+
+my $hash = Text::VCardFast::vcard2hash_c($Card, @args, tuples => 1);
+my $card = $hash->{objects}[0];
+is($card->{type}, 'vcard', "type");
+ok(!exists $card->{properties}, "no properties hash");
+is_deeply($card->{entries}, [
+  [undef, 'version', undef, '3.0'],
+  [undef, 'n', undef, ['Bloggs', 'Joe', '', '', '']],
+  ['item1', 'email', ['type', 'HOME', 'type', 'PREF'], 'joe@example.com'],
+  [undef, 'fn', undef, 'Joe Bloggs'],
+  [undef, 'x-flag', ['type', 'BARE'], 'yes'],
+], "entries in order");
+is_deeply($card->{objects}[0]{entries}, [[undef, 'fn', undef, 'Agent']], "sub card");
+
+{
+  my $text = Text::VCardFast::hash2vcard($hash, "\r\n");
+  like($text, qr/^BEGIN:VCARD\r\nVERSION:3.0\r\nN:Bloggs;Joe;;;\r\nITEM1.EMAIL;TYPE=HOME;TYPE=PREF:joe\@example.com\r\nFN:Joe Bloggs\r\nX-FLAG;TYPE=BARE:yes\r\n/, "hash2vcard keeps order");
+  is_deeply(Text::VCardFast::vcard2hash_c($text, @args), Text::VCardFast::vcard2hash_c($Card, @args), "round trip");
+}
+
+{
+  # plain data, every slot can be changed
+  my $copy = Text::VCardFast::vcard2hash_c($Card, @args, tuples => 1);
+  my $entry = $copy->{objects}[0]{entries}[0];
+  eval { $entry->[0] = 'grp'; $entry->[2] = ['type', 'X'] };
+  is($@, '', "empty slots writable");
+  like(Text::VCardFast::hash2vcard($copy), qr/\nGRP\.VERSION;TYPE=X:3\.0\n/, "and written out");
+}
+
+{
+  my $blob = Text::VCardFast::vcard2blob($Card, @args);
+  is_deeply(Text::VCardFast::blob2hash($blob, tuples => 1), $hash, "blob2hash tuples");
+}
+
+{
+  my $bare = Text::VCardFast::vcard2hash_c($Card, @args, tuples => 1, barekeys => 1);
+  is_deeply($bare->{objects}[0]{entries}[4][2], ['bare', undef], "barekeys");
+  like(Text::VCardFast::hash2vcard($bare), qr/\nX-FLAG;BARE:yes\n/, "bare param written");
+}
+
+foreach my $test (case_names()) {
+  my $vdata = getfile("$Bin/cases/$test.vcf");
+  my $tuples = Text::VCardFast::vcard2hash_c($vdata, @args, tuples => 1);
+  my $text = Text::VCardFast::hash2vcard($tuples);
+  is_deeply(Text::VCardFast::vcard2hash_c($text, @args, tuples => 1), $tuples, "$test round trips as tuples");
+}
+
+done_testing();
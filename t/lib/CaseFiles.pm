@@ -0,0 +1,32 @@
+package CaseFiles;
+
+# the sample cards in t/cases, for the tests which run through all of them
+
+use strict;
+use warnings;
+
+use FindBin qw($Bin);
+use Exporter qw(import);
+
+our @EXPORT = qw(case_names getfile);
+
+sub case_names {
+  my @tests;
+  opendir(my $dh, "$Bin/cases") or die "$Bin/cases: $!";
+  while (my $item = readdir($dh)) {
+    push @tests, $1 if $item =~ m/^(.*)\.vcf$/;
+  }
+  closedir($dh);
+  return sort @tests;
+}
+
+sub getfile {
+  my $file = shift;
+  open(my $fh, "<:encoding(UTF-8)", $file) or return;
+  local $/ = undef;
+  my $res = <$fh>;
+  close($fh);
+  return $res;
+}
+
+1;
@@ -0,0 +1,472 @@
+/* vcardconv.c : bulk convert vcard files with a pool of parser threads
+ *
+ *   vcardconv [-f json|canonical|csv] [-j workers] [-o file]
+ *             [-m name]... [-p name]... [-q] [file...]
+ *
+ * Input is split into jobs at top level card boundaries, so one huge
+ * file is spread over the workers as well as many small ones.  Output
+ * is written in input order whatever order the jobs finish in:
+ *
+ *   json      - one vcard2hash style object per card per line
+ *   canonical - the canonical form of each card (see vcard2canonical)
+ *   csv       - one row per property: file,line,group,name,params,value
+ *
+ * Broken cards are skipped and reported on stderr with their file and
+ * line, and the exit status is 1 if there were any.  A throughput
+ * summary goes to stderr at the end unless -q is given. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "vparse.h"
+
+enum format { FMT_JSON, FMT_CANONICAL, FMT_CSV };
+
+/* cut jobs at the first card boundary after this many bytes */
+#define JOB_BYTES (256 * 1024)
+
+struct job {
+    char *data;         /* our own NUL terminated copy */
+    size_t len;
+    const char *fname;
+    int line;           /* of the first byte in its file */
+    struct buf out;
+    struct buf err;
+    int cards;
+    int errors;
+    int done;
+    struct job *next;       /* waiting to be parsed */
+    struct job *nextout;    /* waiting to be written */
+};
+
+static struct {
+    enum format format;
+    struct vparse_list *multival;
+    struct vparse_list *multiparam;
+    int workers;
+    int quiet;
+    FILE *out;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   /* a job to parse, or finished */
+    pthread_cond_t done;    /* a job has been parsed */
+    struct job *pending, **pendingtail;
+    struct job *order, **ordertail;
+    int inflight;
+    int finished;
+
+    /* totals, only touched by the main thread */
+    size_t bytes;
+    long cards;
+    long errors;
+    int files;
+} conv;
+
+static void _put(struct buf *buf, const char *s, size_t len)
+{
+    if (buf->len + len > buf->alloc) {
+        buf->alloc = (buf->len + len) * 2;
+        buf->s = realloc(buf->s, buf->alloc);
+    }
+    memcpy(buf->s + buf->len, s, len);
+    buf->len += len;
+}
+
+static void _puts(struct buf *buf, const char *s)
+{
+    _put(buf, s, strlen(s));
+}
+
+/* CSV OUTPUT */
+
+static void _csv_field(struct buf *buf, const char *s, int last)
+{
+    if (s && s[strcspn(s, ",\"\r\n")]) {
+        _put(buf, "\"", 1);
+        for (; *s; s++) {
+            if (*s == '"') _put(buf, "\"", 1);
+            _put(buf, s, 1);
+        }
+        _put(buf, "\"", 1);
+    }
+    else if (s) {
+        _puts(buf, s);
+    }
+    _put(buf, last ? "\n" : ",", 1);
+}
+
+static void _csv_card(struct job *job, struct vparse_state *state,
+                      const struct vparse_card *card)
+{
+    const struct vparse_entry *entry;
+    const struct vparse_card *sub;
+    struct buf tmp = BUF_INITIALIZER;
+
+    for (entry = card->properties; entry; entry = entry->next) {
+        const struct vparse_param *param;
+        char num[32];
+        int line, col;
+
+        vparse_linepos(state, entry->srcpos, &line, &col);
+        _csv_field(&job->out, job->fname, 0);
+        snprintf(num, sizeof(num), "%d", job->line + line - 1);
+        _csv_field(&job->out, num, 0);
+        _csv_field(&job->out, entry->group, 0);
+        _csv_field(&job->out, entry->name, 0);
+
+        tmp.len = 0;
+        for (param = entry->params; param; param = param->next) {
+            if (param != entry->params) _put(&tmp, ";", 1);
+            _puts(&tmp, param->name);
+            if (param->value) {
+                _put(&tmp, "=", 1);
+                _puts(&tmp, param->value);
+            }
+        }
+        _put(&tmp, "", 1);
+        _csv_field(&job->out, tmp.s, 0);
+
+        tmp.len = 0;
+        if (entry->multivalue) {
+            const struct vparse_list *item;
+            for (item = entry->v.values; item; item = item->next) {
+                if (item != entry->v.values) _put(&tmp, ";", 1);
+                _puts(&tmp, item->s);
+            }
+        }
+        else if (entry->v.value) {
+            _puts(&tmp, entry->v.value);
+        }
+        _put(&tmp, "", 1);
+        _csv_field(&job->out, tmp.s, 1);
+    }
+
+    for (sub = card->objects; sub; sub = sub->next)
+        _csv_card(job, state, sub);
+
+    vparse_buf_free(&tmp);
+}
+
+/* WORKERS */
+
+static void _run_job(struct job *job)
+{
+    struct vparse_state state;
+    const struct vparse_card *card;
+    const struct vparse_error *error;
+    int r;
+
+    memset(&state, 0, sizeof(struct vparse_state));
+    state.base = job->data;
+    state.multival = conv.multival;
+    state.multiparam = conv.multiparam;
+    state.recover = 1;
+    /* the JSON groups properties by name */
+    state.index = conv.format == FMT_JSON;
+
+    r = vparse_parse(&state, 0);
+
+    for (card = state.card->objects; card; card = card->next) {
+        job->cards++;
+        if (conv.format == FMT_JSON) {
+            vparse_write_json_card(&job->out, card, &state, 0);
+            _put(&job->out, "\n", 1);
+        }
+        else if (conv.format == FMT_CSV) {
+            _csv_card(job, &state, card);
+        }
+    }
+    if (conv.format == FMT_CANONICAL)
+        vparse_write_canonical(&job->out, state.card);
+
+    for (error = state.errors; error; error = error->next) {
+        char msg[512];
+        snprintf(msg, sizeof(msg), "%s:%d:%d: %s\n", job->fname,
+                 job->line + error->pos.errorline - 1, error->pos.errorchar,
+                 vparse_errstr(error->code));
+        _puts(&job->err, msg);
+        job->errors++;
+    }
+    if (r) {
+        struct vparse_errorpos pos;
+        char msg[512];
+        vparse_fillpos(&state, &pos);
+        snprintf(msg, sizeof(msg), "%s:%d:%d: %s\n", job->fname,
+                 job->line + pos.errorline - 1, pos.errorchar, vparse_errstr(r));
+        _puts(&job->err, msg);
+        job->errors++;
+    }
+
+    vparse_free(&state);
+}
+
+static void *_worker(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&conv.lock);
+    for (;;) {
+        struct job *job = conv.pending;
+        if (!job) {
+            if (conv.finished) break;
+            pthread_cond_wait(&conv.ready, &conv.lock);
+            continue;
+        }
+        conv.pending = job->next;
+        if (!conv.pending) conv.pendingtail = &conv.pending;
+        pthread_mutex_unlock(&conv.lock);
+
+        _run_job(job);
+
+        pthread_mutex_lock(&conv.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&conv.done);
+    }
+    pthread_mutex_unlock(&conv.lock);
+
+    return NULL;
+}
+
+/* ORDERED OUTPUT */
+
+/* wait for the oldest job and write it out */
+static void _write_oldest(void)
+{
+    struct job *job;
+
+    pthread_mutex_lock(&conv.lock);
+    job = conv.order;
+    while (!job->done)
+        pthread_cond_wait(&conv.done, &conv.lock);
+    conv.order = job->nextout;
+    if (!conv.order) conv.ordertail = &conv.order;
+    conv.inflight--;
+    pthread_mutex_unlock(&conv.lock);
+
+    if (job->out.len) fwrite(job->out.s, 1, job->out.len, conv.out);
+    if (job->err.len) fwrite(job->err.s, 1, job->err.len, stderr);
+    conv.cards += job->cards;
+    conv.errors += job->errors;
+
+    vparse_buf_free(&job->out);
+    vparse_buf_free(&job->err);
+    free(job->data);
+    free(job);
+}
+
+static void _submit(const char *fname, int line, const char *data, size_t len)
+{
+    struct job *job = calloc(1, sizeof(struct job));
+
+    job->data = malloc(len + 1);
+    memcpy(job->data, data, len);
+    job->data[len] = '\0';
+    job->len = len;
+    job->fname = fname;
+    job->line = line;
+
+    pthread_mutex_lock(&conv.lock);
+    *conv.pendingtail = job;
+    conv.pendingtail = &job->next;
+    *conv.ordertail = job;
+    conv.ordertail = &job->nextout;
+    conv.inflight++;
+    pthread_cond_signal(&conv.ready);
+    pthread_mutex_unlock(&conv.lock);
+
+    /* don't read ahead of the writer without bound */
+    while (conv.inflight >= conv.workers * 4)
+        _write_oldest();
+}
+
+/* INPUT */
+
+static char *_slurp(const char *fname, size_t *lenp)
+{
+    FILE *fh = strcmp(fname, "-") ? fopen(fname, "rb") : stdin;
+    struct buf buf = BUF_INITIALIZER;
+    char chunk[65536];
+    size_t n;
+
+    if (!fh) return NULL;
+    while ((n = fread(chunk, 1, sizeof(chunk), fh)) > 0)
+        _put(&buf, chunk, n);
+    if (fh != stdin) fclose(fh);
+
+    _put(&buf, "", 1);
+    *lenp = buf.len - 1;
+    return buf.s;
+}
+
+/* like vcard2hash_c, a file with no newline followed by anything but
+ * whitespace is taken to use bare CR as the line separator */
+static void _fix_cr(char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i++)
+        if (data[i] == '\n' && !isspace((unsigned char) data[i + 1]))
+            return;
+    for (i = 0; i < len; i++)
+        if (data[i] == '\r') data[i] = '\n';
+}
+
+/* split at top level BEGIN lines; nested cards (BEGIN:VAGENT, or a
+ * vCard 2.1 AGENT holding a whole BEGIN:VCARD) are kept with their
+ * parent */
+static void _split(const char *fname, const char *data, size_t len)
+{
+    const char *start = data, *p = data, *end = data + len;
+    int line = 1, startline = 1, depth = 0;
+
+    while (p < end) {
+        const char *nl;
+
+        if (!strncasecmp(p, "BEGIN:", 6)) {
+            if (!depth && p - start >= JOB_BYTES) {
+                _submit(fname, startline, start, p - start);
+                start = p;
+                startline = line;
+            }
+            depth++;
+        }
+        else if (!strncasecmp(p, "END:", 4) && depth) {
+            depth--;
+        }
+
+        nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+        p = nl + 1;
+        line++;
+    }
+
+    if (end > start)
+        _submit(fname, startline, start, end - start);
+}
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: vcardconv [-f json|canonical|csv] [-j workers] [-o file]\n"
+                    "                 [-m name]... [-p name]... [-q] [file...]\n");
+    exit(2);
+}
+
+static void _addlist(struct vparse_list **listp, const char *s)
+{
+    struct vparse_list *item = malloc(sizeof(struct vparse_list));
+    item->s = strdup(s);
+    item->next = *listp;
+    *listp = item;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t *threads;
+    struct timeval start, end;
+    double secs;
+    int c, i;
+
+    conv.format = FMT_JSON;
+    conv.out = stdout;
+    conv.workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (conv.workers < 1) conv.workers = 1;
+
+    while ((c = getopt(argc, argv, "f:j:o:m:p:q")) != -1) {
+        switch (c) {
+        case 'f':
+            if (!strcmp(optarg, "json")) conv.format = FMT_JSON;
+            else if (!strcmp(optarg, "canonical")) conv.format = FMT_CANONICAL;
+            else if (!strcmp(optarg, "csv")) conv.format = FMT_CSV;
+            else _usage();
+            break;
+        case 'j':
+            conv.workers = atoi(optarg);
+            if (conv.workers < 1) _usage();
+            break;
+        case 'o':
+            conv.out = fopen(optarg, "wb");
+            if (!conv.out) {
+                fprintf(stderr, "vcardconv: %s: %s\n", optarg, strerror(errno));
+                return 2;
+            }
+            break;
+        case 'm':
+            _addlist(&conv.multival, optarg);
+            break;
+        case 'p':
+            _addlist(&conv.multiparam, optarg);
+            break;
+        case 'q':
+            conv.quiet = 1;
+            break;
+        default:
+            _usage();
+        }
+    }
+
+    pthread_mutex_init(&conv.lock, NULL);
+    pthread_cond_init(&conv.ready, NULL);
+    pthread_cond_init(&conv.done, NULL);
+    conv.pendingtail = &conv.pending;
+    conv.ordertail = &conv.order;
+
+    gettimeofday(&start, NULL);
+
+    threads = malloc(conv.workers * sizeof(pthread_t));
+    for (i = 0; i < conv.workers; i++)
+        pthread_create(&threads[i], NULL, _worker, NULL);
+
+    if (conv.format == FMT_CSV)
+        fputs("file,line,group,name,params,value\n", conv.out);
+
+    for (i = optind; i < argc || i == optind; i++) {
+        const char *fname = i < argc ? argv[i] : "-";
+        size_t len;
+        char *data = _slurp(fname, &len);
+
+        if (!data) {
+            fprintf(stderr, "vcardconv: %s: %s\n", fname, strerror(errno));
+            conv.errors++;
+            continue;
+        }
+        _fix_cr(data, len);
+        _split(fname, data, len);
+        conv.bytes += len;
+        conv.files++;
+        free(data);
+    }
+
+    pthread_mutex_lock(&conv.lock);
+    conv.finished = 1;
+    pthread_cond_broadcast(&conv.ready);
+    pthread_mutex_unlock(&conv.lock);
+
+    while (conv.order)
+        _write_oldest();
+    for (i = 0; i < conv.workers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    if (fflush(conv.out) || (conv.out != stdout && fclose(conv.out))) {
+        fprintf(stderr, "vcardconv: write failed: %s\n", strerror(errno));
+        return 2;
+    }
+
+    gettimeofday(&end, NULL);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    if (secs <= 0) secs = 1e-6;
+
+    if (!conv.quiet)
+        fprintf(stderr, "vcardconv: %d files, %ld cards, %zu bytes in %.3fs"
+                        " (%.1f MB/s, %.0f cards/s, %d workers), %ld errors\n",
+                conv.files, conv.cards, conv.bytes, secs,
+                conv.bytes / secs / 1e6, conv.cards / secs, conv.workers, conv.errors);
+
+    return conv.errors ? 1 : 0;
+}
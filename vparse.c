@@ -7,6 +7,14 @@
 
 #include "vparse.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET 1
+#endif
+
 static int strcmpsafe(const char *a, const char *b)
 {
    if (!a) a = "";
@@ -28,11 +36,18 @@ static size_t roundup(size_t size)
         return 256;
     if (size < 512)
         return 512;
-    return ((size + 1024) & ~1023);
+    /* geometric from here on, so a huge value costs a logarithmic
+     * number of reallocs rather than one per kilobyte */
+    size_t res = 1024;
+    while (res < size)
+        res *= 2;
+    return res;
 }
 
 #define buf_ensure(b, n) do { if ((b)->alloc < (b)->len + (n)) _buf_ensure((b), (n)); } while (0)
 #define buf_putc(b, c) do { buf_ensure((b), 1); (b)->s[(b)->len++] = (c); } while (0)
+#define buf_putn(b, str, n) do { buf_ensure((b), (n)); memcpy((b)->s + (b)->len, (str), (n)); (b)->len += (n); } while (0)
+#define buf_puts(b, str) do { const char *s_ = (str); size_t n_ = strlen(s_); buf_putn((b), s_, n_); } while (0)
 #define LC(s) do { char *p; for (p = s; *p; p++) if (*p >= 'A' && *p <= 'Z') *p += ('a' - 'A'); } while (0)
 
 static void _buf_ensure(struct buf *buf, size_t n)
@@ -48,20 +63,15 @@ static void _buf_ensure(struct buf *buf, size_t n)
 
 static char *buf_dup_cstring(struct buf *buf)
 {
-    char *ret = strndup(buf->s, buf->len);
+    char *ret = malloc(buf->len + 1);
+    if (buf->len) memcpy(ret, buf->s, buf->len);
+    ret[buf->len] = '\0';
     /* more space efficient than returning overlength buffers, and
      * you would just wind up mallocing another buffer anyway */
     buf->len = 0;
     return ret;
 }
 
-static char *buf_dup_lcstring(struct buf *buf)
-{
-    char *ret = buf_dup_cstring(buf);
-    LC(ret);
-    return ret;
-}
-
 static void buf_free(struct buf *buf)
 {
     free(buf->s);
@@ -69,11 +79,386 @@ static void buf_free(struct buf *buf)
     buf->len = buf->alloc = 0;
 }
 
+/* ARENA
+ *
+ * Everything the parsers hang off a tree - cards, entries, params,
+ * values and their strings - is carved out of big chunks in the order
+ * it is parsed, so a card and everything in it sit next to each other
+ * in memory, and the whole tree goes with one free per chunk.  Parts
+ * thrown away mid parse just stay in the arena until then. */
+
+#define ARENA_CHUNK 16384
+#define ARENA_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct vparse_chunk {
+    struct vparse_chunk *next;
+    size_t size; /* also keeps the data 16 byte aligned */
+};
+
+static void *_arena_alloc(struct vparse_arena *arena, size_t len)
+{
+    struct vparse_chunk *chunk;
+    void *res;
+
+    len = ARENA_ALIGN(len);
+    if (len <= arena->left) {
+        res = arena->p;
+        arena->p += len;
+        arena->left -= len;
+        return res;
+    }
+
+    /* big things get a chunk of their own, behind the current one so
+     * its free space isn't wasted */
+    if (len > ARENA_CHUNK / 4) {
+        chunk = malloc(sizeof(struct vparse_chunk) + len);
+        chunk->size = len;
+        if (arena->chunk) {
+            chunk->next = arena->chunk->next;
+            arena->chunk->next = chunk;
+        }
+        else {
+            chunk->next = NULL;
+            arena->chunk = chunk;
+        }
+        return chunk + 1;
+    }
+
+    chunk = malloc(sizeof(struct vparse_chunk) + ARENA_CHUNK);
+    chunk->size = ARENA_CHUNK;
+    chunk->next = arena->chunk;
+    arena->chunk = chunk;
+    res = chunk + 1;
+    arena->p = (char *) res + len;
+    arena->left = ARENA_CHUNK - len;
+    return res;
+}
+
+static void *_arena_zalloc(struct vparse_arena *arena, size_t len)
+{
+    void *res = _arena_alloc(arena, len);
+    memset(res, 0, len);
+    return res;
+}
+
+static char *_arena_strndup(struct vparse_arena *arena, const char *s, size_t len)
+{
+    char *res = _arena_alloc(arena, len + 1);
+    if (len) memcpy(res, s, len);
+    res[len] = '\0';
+    return res;
+}
+
+static char *_arena_strdup(struct vparse_arena *arena, const char *s)
+{
+    return _arena_strndup(arena, s, strlen(s));
+}
+
+/* take the string off the buffer, like buf_dup_cstring */
+static char *_arena_dup_buf(struct vparse_arena *arena, struct buf *buf)
+{
+    char *res = _arena_strndup(arena, buf->s, buf->len);
+    buf->len = 0;
+    return res;
+}
+
+static char *_arena_dup_lcbuf(struct vparse_arena *arena, struct buf *buf)
+{
+    char *res = _arena_dup_buf(arena, buf);
+    LC(res);
+    return res;
+}
+
+/* where the arena was, so everything allocated since can be given back */
+struct arena_mark {
+    struct vparse_chunk *chunk;
+    struct vparse_chunk *next;
+    char *p;
+    size_t left;
+};
+
+static void _arena_mark(struct vparse_arena *arena, struct arena_mark *mark)
+{
+    mark->chunk = arena->chunk;
+    mark->next = arena->chunk ? arena->chunk->next : NULL;
+    mark->p = arena->p;
+    mark->left = arena->left;
+}
+
+static void _arena_release(struct vparse_arena *arena, const struct arena_mark *mark)
+{
+    struct vparse_chunk *chunk, *next;
+
+    /* chunks started since, and the big ones behind them */
+    while (arena->chunk != mark->chunk) {
+        chunk = arena->chunk;
+        arena->chunk = chunk->next;
+        free(chunk);
+    }
+
+    /* big ones linked behind the marked chunk */
+    if (mark->chunk) {
+        for (chunk = mark->chunk->next; chunk != mark->next; chunk = next) {
+            next = chunk->next;
+            free(chunk);
+        }
+        mark->chunk->next = mark->next;
+    }
+
+    arena->p = mark->p;
+    arena->left = mark->left;
+}
+
+static void _arena_free(struct vparse_arena *arena)
+{
+    struct vparse_chunk *chunk, *next;
+
+    for (chunk = arena->chunk; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    memset(arena, 0, sizeof(struct vparse_arena));
+}
+
+/* CHARACTER CLASSES
+ *
+ * For each parser state, the bytes which end a run of plain characters
+ * there (NUL always does), as a table and as a string.  PUTRUN tests the
+ * first few bytes of a run against the table, which is all most runs
+ * need, and only calls strcspn for long ones, where its vector loop
+ * wins.  Only the special bytes reach the switch in each _parse_*
+ * function. */
+
+struct char_class {
+    const char *stop;
+    unsigned char special[256];
+};
+
+#define CLASS_END [0] = 1, ['\r'] = 1, ['\n'] = 1
+#define CLASS_SHORT 16
+
+static const struct char_class _class_qstring = {
+    "\"\\^\r\n,", { CLASS_END, ['"'] = 1, ['\\'] = 1, ['^'] = 1, [','] = 1 }
+};
+static const struct char_class _class_paramkey = {
+    "=;:\r\n", { CLASS_END, ['='] = 1, [';'] = 1, [':'] = 1 }
+};
+static const struct char_class _class_paramvalue = {
+    "\\^\":;\r\n,", { CLASS_END, ['\\'] = 1, ['^'] = 1, ['"'] = 1, [':'] = 1, [';'] = 1, [','] = 1 }
+};
+static const struct char_class _class_name = {
+    ":;.\r\n", { CLASS_END, [':'] = 1, [';'] = 1, ['.'] = 1 }
+};
+static const struct char_class _class_multivalue = {
+    "\\;\r\n", { CLASS_END, ['\\'] = 1, [';'] = 1 }
+};
+static const struct char_class _class_value = {
+    "\\\r\n", { CLASS_END, ['\\'] = 1 }
+};
+/* control characters aren't allowed in JSON strings at all */
+static const struct char_class _class_jstring = {
+    "\"\\\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+    "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f",
+    { [0] = 1, [1] = 1, [2] = 1, [3] = 1, [4] = 1, [5] = 1, [6] = 1, [7] = 1,
+      [8] = 1, [9] = 1, [10] = 1, [11] = 1, [12] = 1, [13] = 1, [14] = 1,
+      [15] = 1, [16] = 1, [17] = 1, [18] = 1, [19] = 1, [20] = 1, [21] = 1,
+      [22] = 1, [23] = 1, [24] = 1, [25] = 1, [26] = 1, [27] = 1, [28] = 1,
+      [29] = 1, [30] = 1, [31] = 1, ['"'] = 1, ['\\'] = 1 }
+};
+
+/* length of the run at p, the first byte of which is taken as plain */
+static size_t _class_run(const char *p, const struct char_class *class)
+{
+    const unsigned char *s = (const unsigned char *) p;
+    size_t n;
+
+    for (n = 1; n < CLASS_SHORT; n++)
+        if (class->special[s[n]]) return n;
+
+    return n + strcspn(p + n, class->stop);
+}
+
+/* STRUCTURAL INDEX
+ *
+ * The other way to find the end of a run: a first stage marks every
+ * byte which is special anywhere in the grammar in a bitmap, 32 bytes at
+ * a time with AVX2 when the CPU has it, else 16 with SSE2, else one by
+ * one, and PUTRUN then jumps between set bits rather than scanning for
+ * its own stop characters.  The bitmap covers a window of the input just
+ * ahead of the parser rather than all of it, so it stays in cache and
+ * costs nothing to allocate. */
+
+#define STRUCTURAL_WINDOW 4096
+
+static const unsigned char _structural_class[256] = {
+    ['\n'] = 1, ['\r'] = 1, [':'] = 1, [';'] = 1, [','] = 1,
+    ['.'] = 1, ['='] = 1, ['"'] = 1, ['\\'] = 1, ['^'] = 1,
+};
+
+#ifdef HAVE_AVX2_TARGET
+/* a byte is special if the entries for its two nibbles share a bit:
+ * bit 0 is 0x0_, bit 1 0x2_, bit 2 0x3_ and bit 3 0x5_ */
+__attribute__((target("avx2")))
+static size_t _structural_avx2(const unsigned char *s, size_t len, uint64_t *map)
+{
+    const __m256i lo = _mm256_setr_epi8(
+        0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 5, 4, 10, 5, 10, 0,
+        0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 5, 4, 10, 5, 10, 0);
+    const __m256i hi = _mm256_setr_epi8(
+        1, 0, 2, 4, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        1, 0, 2, 4, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (s + i + 32));
+        __m256i ca = _mm256_and_si256(_mm256_shuffle_epi8(lo, a),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(a, 4), nibble)));
+        __m256i cb = _mm256_and_si256(_mm256_shuffle_epi8(lo, b),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble)));
+        uint64_t plain = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(ca, zero))
+                       | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(cb, zero)) << 32;
+        map[i / 64] = ~plain;
+    }
+
+    return i;
+}
+#endif
+
+#ifdef __SSE2__
+static size_t _structural_sse2(const unsigned char *s, size_t len, uint64_t *map)
+{
+    /* pairs one bit apart share a compare: ; and :, . and ,  ^ and \\ */
+    const __m128i c_nl = _mm_set1_epi8('\n'), c_cr = _mm_set1_epi8('\r');
+    const __m128i c_quote = _mm_set1_epi8('"'), c_eq = _mm_set1_epi8('=');
+    const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+    const __m128i c_semi = _mm_set1_epi8(';'), c_dot = _mm_set1_epi8('.');
+    const __m128i c_caret = _mm_set1_epi8('^');
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64) {
+        uint64_t bits = 0;
+        int k;
+        for (k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (s + i + 16 * k));
+            __m128i v1 = _mm_or_si128(v, one);
+            __m128i v2 = _mm_or_si128(v, two);
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, c_nl), _mm_cmpeq_epi8(v, c_cr));
+            m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, c_quote), _mm_cmpeq_epi8(v, c_eq)));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v1, c_semi));
+            m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v2, c_dot), _mm_cmpeq_epi8(v2, c_caret)));
+            bits |= (uint64_t) (unsigned) _mm_movemask_epi8(m) << (16 * k);
+        }
+        map[i / 64] = bits;
+    }
+
+    return i;
+}
+#endif
+
+/* the window starting at start, which is a multiple of 64 */
+static void _structural_window(struct vparse_state *state, size_t start)
+{
+    const unsigned char *s = (const unsigned char *) state->base + start;
+    uint64_t *map = state->smap;
+    size_t len = state->slen - start;
+    size_t i = 0;
+
+    if (len > STRUCTURAL_WINDOW) len = STRUCTURAL_WINDOW;
+    memset(map, 0, STRUCTURAL_WINDOW / 8);
+
+#ifdef HAVE_AVX2_TARGET
+    if (state->structural == VPARSE_STRUCTURAL_BEST && __builtin_cpu_supports("avx2"))
+        i = _structural_avx2(s, len, map);
+    else
+#endif
+#ifdef __SSE2__
+    if (state->structural != VPARSE_STRUCTURAL_SCALAR)
+        i = _structural_sse2(s, len, map);
+#endif
+
+    for (; i < len; i++)
+        if (_structural_class[s[i]])
+            map[i / 64] |= (uint64_t) 1 << (i % 64);
+
+    /* so a search always stops at the end */
+    if (len < STRUCTURAL_WINDOW)
+        map[len / 64] |= (uint64_t) 1 << (len % 64);
+
+    state->sstart = start;
+}
+
+static void _structural_init(struct vparse_state *state)
+{
+    if (!state->smap) state->smap = malloc(STRUCTURAL_WINDOW / 8);
+    state->slen = strlen(state->base);
+    state->sstart = (size_t) -1; /* nothing yet */
+}
+
+static int _ctz64(uint64_t word)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int n = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* same as _class_run(state->p, class) */
+static size_t _structural_run(struct vparse_state *state, const struct char_class *class)
+{
+    size_t start = state->p - state->base;
+    size_t pos = start + 1;
+
+    for (;;) {
+        size_t w;
+        uint64_t word;
+
+        if (pos < state->sstart || pos >= state->sstart + STRUCTURAL_WINDOW)
+            _structural_window(state, pos & ~(size_t) 63);
+
+        w = (pos - state->sstart) / 64;
+        word = state->smap[w] & (~(uint64_t) 0 << (pos % 64));
+        while (!word && ++w < STRUCTURAL_WINDOW / 64)
+            word = state->smap[w];
+        if (!word) {
+            pos = state->sstart + STRUCTURAL_WINDOW;
+            continue;
+        }
+
+        for (; word; word &= word - 1) {
+            pos = state->sstart + w * 64 + _ctz64(word);
+            if (class->special[(unsigned char) state->base[pos]])
+                return pos - start;
+        }
+        pos++;
+    }
+}
+
+static void _fp_entry(struct buf *buf, const struct vparse_entry *entry, uint64_t out[2]);
+static void _fp_finish(struct buf *buf, struct vparse_card *card);
+static void _fp_add(uint64_t acc[2], const uint64_t h[2]);
+static struct vparse_index *_index_build(struct vparse_card *card, struct vparse_arena *arena);
 
 #define NOTESTART() state->itemstart = state->p
 #define MAKE(X, Y) X = malloc(sizeof(struct Y)); memset(X, 0, sizeof(struct Y))
+/* tree nodes and strings come from the arena */
+#define NEW(X, Y) X = _arena_zalloc(&state->arena, sizeof(struct Y))
+#define STRDUP(S) _arena_strdup(&state->arena, (S))
+#define BUFDUP() _arena_dup_buf(&state->arena, &state->buf)
+#define BUFDUPLC() _arena_dup_lcbuf(&state->arena, &state->buf)
 #define PUTC(C) buf_putc(&state->buf, C)
 #define INC(I) state->p += I
+/* copy the current character and every following one which isn't
+ * special in CLASS onto the buffer in one go */
+#define PUTRUN(CLASS) do { size_t n_ = state->smap ? _structural_run(state, CLASS) : _class_run(state->p, CLASS); buf_putn(&state->buf, state->p, n_); INC(n_); } while (0)
 
 /* just leaves it on the buffer */
 static int _parse_param_quoted(struct vparse_state *state, int multiparam)
@@ -148,8 +533,7 @@ static int _parse_param_quoted(struct vparse_state *state, int multiparam)
             /* or fall through, comma isn't special */
 
         default:
-            PUTC(*state->p);
-            INC(1);
+            PUTRUN(&_class_qstring);
             break;
         }
     }
@@ -164,7 +548,7 @@ static int _parse_param_key(struct vparse_state *state, int *haseq)
     while (*state->p) {
         switch (*state->p) {
         case '=':
-            state->param->name = buf_dup_lcstring(&state->buf);
+            state->param->name = BUFDUPLC();
             *haseq = 1;
             INC(1);
             return 0;
@@ -172,11 +556,11 @@ static int _parse_param_key(struct vparse_state *state, int *haseq)
         case ';': /* vcard 2.1 parameter with no value */
         case ':':
             if (state->barekeys) {
-                state->param->name = buf_dup_lcstring(&state->buf);
+                state->param->name = BUFDUPLC();
             }
             else {
-                state->param->name = strdup("type");
-                state->param->value = buf_dup_cstring(&state->buf);
+                state->param->name = STRDUP("type");
+                state->param->value = BUFDUP();
             }
             /* no INC - we need to see this char up a layer */
             return 0;
@@ -192,8 +576,7 @@ static int _parse_param_key(struct vparse_state *state, int *haseq)
 
         /* XXX - check exact legal set? */
         default:
-            PUTC(*state->p);
-            INC(1);
+            PUTRUN(&_class_paramkey);
             break;
         }
     }
@@ -212,7 +595,7 @@ static int _parse_entry_params(struct vparse_state *state)
 repeat:
     multiparam = 0;
     haseq = 0;
-    MAKE(state->param, vparse_param);
+    NEW(state->param, vparse_param);
 
     NOTESTART();
 
@@ -277,11 +660,11 @@ repeat:
             loop:
             r = _parse_param_quoted(state, multiparam);
             if (r == PE_QSTRING_COMMA) {
-                char *name = strdup(state->param->name);
-                state->param->value = buf_dup_cstring(&state->buf);
+                char *name = STRDUP(state->param->name);
+                state->param->value = BUFDUP();
                 *paramp = state->param;
                 paramp = &state->param->next;
-                MAKE(state->param, vparse_param);
+                NEW(state->param, vparse_param);
                 state->param->name = name;
                 INC(1);
                 goto loop;
@@ -292,7 +675,7 @@ repeat:
         case ':':
             /* done - all parameters parsed */
             if (haseq)
-                state->param->value = buf_dup_cstring(&state->buf);
+                state->param->value = BUFDUP();
             *paramp = state->param;
             state->param = NULL;
             INC(1);
@@ -301,7 +684,7 @@ repeat:
         case ';':
             /* another parameter to parse */
             if (haseq)
-                state->param->value = buf_dup_cstring(&state->buf);
+                state->param->value = BUFDUP();
             *paramp = state->param;
             paramp = &state->param->next;
             INC(1);
@@ -318,12 +701,12 @@ repeat:
 
         case ',':
             if (multiparam) {
-                char *name = strdup(state->param->name);
+                char *name = STRDUP(state->param->name);
                 if (haseq)
-                    state->param->value = buf_dup_cstring(&state->buf);
+                    state->param->value = BUFDUP();
                 *paramp = state->param;
                 paramp = &state->param->next;
-                MAKE(state->param, vparse_param);
+                NEW(state->param, vparse_param);
                 state->param->name = name;
                 INC(1);
                 break;
@@ -331,8 +714,7 @@ repeat:
             /* or fall through, comma isn't special */
 
         default:
-            PUTC(*state->p);
-            INC(1);
+            PUTRUN(&_class_paramvalue);
             break;
         }
     }
@@ -347,19 +729,19 @@ static int _parse_entry_key(struct vparse_state *state)
     while (*state->p) {
         switch (*state->p) {
         case ':':
-            state->entry->name = buf_dup_lcstring(&state->buf);
+            state->entry->name = BUFDUPLC();
             INC(1);
             return 0;
 
         case ';':
-            state->entry->name = buf_dup_lcstring(&state->buf);
+            state->entry->name = BUFDUPLC();
             INC(1);
             return _parse_entry_params(state);
 
         case '.':
             if (state->entry->group)
                 return PE_ENTRY_MULTIGROUP;
-            state->entry->group = buf_dup_lcstring(&state->buf);
+            state->entry->group = BUFDUPLC();
             INC(1);
             break;
 
@@ -376,8 +758,7 @@ static int _parse_entry_key(struct vparse_state *state)
             break;
 
         default:
-            PUTC(*state->p);
-            INC(1);
+            PUTRUN(&_class_name);
             break;
         }
     }
@@ -394,7 +775,7 @@ static int _parse_entry_multivalue(struct vparse_state *state)
     NOTESTART();
 
 repeat:
-    MAKE(state->value, vparse_list);
+    NEW(state->value, vparse_list);
 
     while (*state->p) {
         switch (*state->p) {
@@ -417,7 +798,7 @@ repeat:
             break;
 
         case ';':
-            state->value->s = buf_dup_cstring(&state->buf);
+            state->value->s = BUFDUP();
             *valp = state->value;
             valp = &state->value->next;
             INC(1);
@@ -436,8 +817,7 @@ repeat:
             goto out;
 
         default:
-            PUTC(*state->p);
-            INC(1);
+            PUTRUN(&_class_multivalue);
             break;
         }
     }
@@ -445,7 +825,7 @@ repeat:
 out:
     /* reaching the end of the file isn't a failure here,
      * it's just another type of end-of-value */
-    state->value->s = buf_dup_cstring(&state->buf);
+    state->value->s = BUFDUP();
     *valp = state->value;
     state->value = NULL;
     return 0;
@@ -454,6 +834,7 @@ out:
 static int _parse_entry_value(struct vparse_state *state)
 {
     struct vparse_list *item;
+    int raw = 1;
 
     for (item = state->multival; item; item = item->next)
         if (!strcmpsafe(state->entry->name, item->s))
@@ -465,6 +846,7 @@ static int _parse_entry_value(struct vparse_state *state)
         switch (*state->p) {
         /* only one type of quoting */
         case '\\':
+            raw = 0;
             /* seen in the wild - \n split by line wrapping */
             if (state->p[1] == '\r') INC(1);
             if (state->p[1] == '\n') {
@@ -483,10 +865,12 @@ static int _parse_entry_value(struct vparse_state *state)
             break;
 
         case '\r':
+            if (state->p[1] != '\n') raw = 0;
             INC(1);
             break; /* just skip */
         case '\n':
             if (state->p[1] == ' ' || state->p[1] == '\t') {/* wrapped line */
+                raw = 0;
                 INC(2);
                 break;
             }
@@ -495,8 +879,7 @@ static int _parse_entry_value(struct vparse_state *state)
             goto out;
 
         default:
-            PUTC(*state->p);
-            INC(1);
+            PUTRUN(&_class_value);
             break;
         }
     }
@@ -504,7 +887,8 @@ static int _parse_entry_value(struct vparse_state *state)
 out:
     /* reaching the end of the file isn't a failure here,
      * it's just another type of end-of-value */
-    state->entry->v.value = buf_dup_cstring(&state->buf);
+    if (raw) state->entry->rawpos = state->itemstart - state->base;
+    state->entry->v.value = BUFDUP();
     return 0;
 }
 
@@ -557,19 +941,39 @@ static void _free_card(struct vparse_card *card)
     for (; card; card = cardnext) {
         cardnext = card->next;
         free(card->type);
+        free(card->index);
         _free_entry(card->properties);
         _free_card(card->objects);
         free(card);
     }
 }
 
+static void _free_errors(struct vparse_error *error)
+{
+    struct vparse_error *errornext;
+
+    for (; error; error = errornext) {
+        errornext = error->next;
+        free(error);
+    }
+}
+
 static void _free_state(struct vparse_state *state)
 {
     buf_free(&state->buf);
-    _free_card(state->card);
-    _free_list(state->value);
-    _free_entry(state->entry);
-    _free_param(state->param);
+    _free_errors(state->errors);
+    free(state->lines.nl);
+    free(state->smap);
+    if (state->arena.chunk) {
+        _arena_free(&state->arena);
+    }
+    else {
+        /* a tree put together outside the parser */
+        _free_card(state->card);
+        _free_list(state->value);
+        _free_entry(state->entry);
+        _free_param(state->param);
+    }
 
     memset(state, 0, sizeof(struct vparse_state));
 }
@@ -581,11 +985,77 @@ static int _parse_entry(struct vparse_state *state)
     return _parse_entry_value(state);
 }
 
+/* is there a "BEGIN:type" line starting at p?  type NULL matches any */
+static int _is_begin_line(const char *p, const char *type)
+{
+    size_t len;
+
+    if (strncasecmp(p, "begin:", 6))
+        return 0;
+    if (!type)
+        return 1;
+
+    p += 6;
+    len = strlen(type);
+    if (strncasecmp(p, type, len))
+        return 0;
+    p += len;
+
+    return (*p == '\r' || *p == '\n' || !*p);
+}
+
+/* recover mode: note the error, throw away the partial item and skip
+ * forward to the next line which opens a card of the same type.  The
+ * region from itemstart to there is never parsed again */
+static void _recover(struct vparse_state *state, int r,
+                     const char *itemstart, const char *type)
+{
+    struct vparse_error *error;
+    const char *p = itemstart;
+
+    MAKE(error, vparse_error);
+    error->code = r;
+    error->skipstart = itemstart - state->base;
+
+    *state->errortail = error;
+    state->errortail = &error->next;
+
+    /* the partial item stays in the arena */
+    state->value = NULL;
+    state->entry = NULL;
+    state->param = NULL;
+    state->buf.len = 0;
+
+    while (*p) {
+        p = strchr(p, '\n');
+        if (!p) {
+            p = state->base + strlen(state->base);
+            break;
+        }
+        p++;
+        if (_is_begin_line(p, type))
+            break;
+    }
+
+    error->skipend = p - state->base;
+
+    /* a card which lost its END fails wherever the cards it swallowed
+     * ran out, so keep the error inside the region it is skipped with */
+    if (r == PE_FINISHED_EARLY || state->itemstart < itemstart || state->itemstart >= p)
+        state->itemstart = itemstart;
+    if (state->p < itemstart || state->p >= p)
+        state->p = p - 1;
+    vparse_fillpos(state, &error->pos);
+
+    state->p = p;
+}
+
 static int _parse_vcard(struct vparse_state *state, struct vparse_card *card, int only_one)
 {
     struct vparse_card **subp = &card->objects;
     struct vparse_entry **entryp = &card->properties;
     struct vparse_card *sub;
+    struct arena_mark mark;
     const char *cardstart = state->p;
     const char *entrystart;
     int r;
@@ -598,68 +1068,135 @@ static int _parse_vcard(struct vparse_state *state, struct vparse_card *card, in
         }
 
         entrystart = state->p;
+        if (state->sink && card == state->card)
+            _arena_mark(&state->arena, &mark);
 
-        MAKE(state->entry, vparse_entry);
+        NEW(state->entry, vparse_entry);
+        state->entry->srcpos = entrystart - state->base;
 
         r = _parse_entry(state);
-        if (r) return r;
+        if (r) goto fail;
 
         if (!strcmpsafe(state->entry->name, "begin")) {
             /* shouldn't be any params */
             if (state->entry->params) {
                 state->itemstart = entrystart;
-                return PE_BEGIN_PARAMS;
+                r = PE_BEGIN_PARAMS;
+                goto fail;
             }
             /* only possible if some idiot passes 'begin' as
              * multivalue field name */
             if (state->entry->multivalue) {
                 state->itemstart = entrystart;
-                return PE_BEGIN_PARAMS;
+                r = PE_BEGIN_PARAMS;
+                goto fail;
             }
 
-            MAKE(sub, vparse_card);
-            sub->type = strdup(state->entry->v.value);
+            NEW(sub, vparse_card);
+            sub->type = STRDUP(state->entry->v.value);
             LC(sub->type);
-            _free_entry(state->entry);
             state->entry = NULL;
-            /* we must stitch it in first, because state won't hold it */
-            *subp = sub;
-            subp = &sub->next;
+            if (card == state->top && state->unnested && !strcmp(sub->type, card->type)) {
+                /* this card has lost its END too, so leave the BEGIN for
+                 * _recover to stop at rather than parsing to the end again */
+                return PE_FINISHED_EARLY;
+            }
+            if (card == state->card)
+                state->top = sub;
+            if (state->sink) {
+                state->sink->begin_card(state->sink->rock, sub->type);
+            }
+            else {
+                /* we must stitch it in first, because state won't hold it */
+                *subp = sub;
+            }
             r = _parse_vcard(state, sub, /*only_one*/0);
-            if (r) return r;
+            if (r) {
+                if (card != state->card || !state->recover) return r;
+                /* unstitch the broken card again */
+                *subp = NULL;
+                if (r == PE_FINISHED_EARLY)
+                    state->unnested = 1;
+                _recover(state, r, entrystart, sub->type);
+                if (state->sink) {
+                    state->sink->abort_card(state->sink->rock);
+                    _arena_release(&state->arena, &mark);
+                }
+                continue;
+            }
+            if (state->sink) {
+                state->sink->end_card(state->sink->rock, sub);
+                if (state->fingerprint)
+                    _fp_add(card->fingerprint, sub->fingerprint);
+                /* the sink has all of a top level card by now */
+                if (card == state->card)
+                    _arena_release(&state->arena, &mark);
+            }
+            else {
+                subp = &sub->next;
+                if (state->fingerprint)
+                    _fp_add(card->fingerprint, sub->fingerprint);
+            }
             if (only_one) return 0;
         }
         else if (!strcmpsafe(state->entry->name, "end")) {
             /* shouldn't be any params */
             if (state->entry->params) {
                 state->itemstart = entrystart;
-                return PE_BEGIN_PARAMS;
+                r = PE_BEGIN_PARAMS;
+                goto fail;
             }
             /* only possible if some idiot passes 'end' as
              * multivalue field name */
             if (state->entry->multivalue) {
                 state->itemstart = entrystart;
-                return PE_BEGIN_PARAMS;
+                r = PE_BEGIN_PARAMS;
+                goto fail;
             }
 
             if (!card->type || strcasecmp(state->entry->v.value, card->type)) {
                 /* special case mismatched card, the "start" was the start of
                  * the card */
                 state->itemstart = cardstart;
-                return PE_MISMATCHED_CARD;
+                r = PE_MISMATCHED_CARD;
+                goto fail;
             }
 
-            _free_entry(state->entry);
             state->entry = NULL;
 
+            if (state->fingerprint)
+                _fp_finish(&state->buf, card);
+            if (state->index)
+                card->index = _index_build(card, &state->arena);
+
             return 0;
         }
         else {
             /* it's a parameter on this one */
-            *entryp = state->entry;
-            entryp = &state->entry->next;
+            if (state->fingerprint) {
+                uint64_t h[2];
+                _fp_entry(&state->buf, state->entry, h);
+                _fp_add(card->fingerprint, h);
+            }
+            if (state->sink && !card->type) {
+                /* nothing outside a card goes to the sink */
+                _arena_release(&state->arena, &mark);
+            }
+            else {
+                *entryp = state->entry;
+                entryp = &state->entry->next;
+            }
             state->entry = NULL;
         }
+        continue;
+
+    fail:
+        /* only junk between the top level cards can be skipped here,
+         * errors inside a card unwind up to the BEGIN that opened it */
+        if (card != state->card || !state->recover) return r;
+        _recover(state, r, entrystart, NULL);
+        if (state->sink)
+            _arena_release(&state->arena, &mark);
     }
 
     if (card->type)
@@ -668,146 +1205,2488 @@ static int _parse_vcard(struct vparse_state *state, struct vparse_card *card, in
     return 0;
 }
 
-/* PUBLIC API */
-
-int vparse_parse(struct vparse_state *state, int only_one)
-{
-    MAKE(state->card, vparse_card);
+/* HASHING
+ *
+ * MurmurHash3 x64_128 (Austin Appleby, public domain), reading blocks
+ * little endian so the result is the same on every platform */
 
-    state->p = state->base;
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
 
-    /* don't parse trailing non-whitespace */
-    return _parse_vcard(state, state->card, only_one);
+static uint64_t _getblock64(const unsigned char *p)
+{
+    return (uint64_t) p[0] | ((uint64_t) p[1] << 8)
+         | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+         | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+         | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
 }
 
-void vparse_free(struct vparse_state *state)
+static uint64_t _fmix64(uint64_t k)
 {
-    _free_state(state);
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
 }
 
-void vparse_fillpos(struct vparse_state *state, struct vparse_errorpos *pos)
+static void _murmur3_128(const char *key, size_t len, uint64_t seed, uint64_t out[2])
 {
-    int l = 1;
-    int c = 0;
-    const char *p;
+    const unsigned char *data = (const unsigned char *) key;
+    const unsigned char *tail;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    size_t nblocks = len / 16;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+    uint64_t k1, k2;
+    size_t i;
+
+    for (i = 0; i < nblocks; i++) {
+        k1 = _getblock64(data + i * 16);
+        k2 = _getblock64(data + i * 16 + 8);
+
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
 
-    memset(pos, 0, sizeof(struct vparse_errorpos));
+    tail = data + nblocks * 16;
+    k1 = 0;
+    k2 = 0;
+
+    switch (len & 15) {
+    case 15: k2 ^= (uint64_t) tail[14] << 48; /* fall through */
+    case 14: k2 ^= (uint64_t) tail[13] << 40; /* fall through */
+    case 13: k2 ^= (uint64_t) tail[12] << 32; /* fall through */
+    case 12: k2 ^= (uint64_t) tail[11] << 24; /* fall through */
+    case 11: k2 ^= (uint64_t) tail[10] << 16; /* fall through */
+    case 10: k2 ^= (uint64_t) tail[9] << 8;   /* fall through */
+    case 9:  k2 ^= (uint64_t) tail[8];
+             k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+             /* fall through */
+    case 8:  k1 ^= (uint64_t) tail[7] << 56;  /* fall through */
+    case 7:  k1 ^= (uint64_t) tail[6] << 48;  /* fall through */
+    case 6:  k1 ^= (uint64_t) tail[5] << 40;  /* fall through */
+    case 5:  k1 ^= (uint64_t) tail[4] << 32;  /* fall through */
+    case 4:  k1 ^= (uint64_t) tail[3] << 24;  /* fall through */
+    case 3:  k1 ^= (uint64_t) tail[2] << 16;  /* fall through */
+    case 2:  k1 ^= (uint64_t) tail[1] << 8;   /* fall through */
+    case 1:  k1 ^= (uint64_t) tail[0];
+             k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
 
-    pos->errorpos = state->p - state->base;
-    pos->startpos = state->itemstart - state->base;
+    h1 ^= (uint64_t) len;
+    h2 ^= (uint64_t) len;
 
-    for (p = state->base; p < state->p; p++) {
-        if (*p == '\n') {
-            l++;
-            c = 0;
-        }
-        else {
-            c++;
-        }
-        if (p == state->itemstart) {
-            pos->startline = l;
-            pos->startchar = c;
-        }
-    }
+    h1 += h2;
+    h2 += h1;
+
+    h1 = _fmix64(h1);
+    h2 = _fmix64(h2);
 
-    pos->errorline = l;
-    pos->errorchar = c;
+    h1 += h2;
+    h2 += h1;
+
+    out[0] = h1;
+    out[1] = h2;
 }
 
-const char *vparse_errstr(int err)
+/* OUTPUT */
+
+#define FOLDLEN 75
+
+static void _write_uc(struct buf *buf, const char *s)
 {
-    switch(err) {
-    case PE_BACKQUOTE_EOF:
-        return "EOF after backslash";
-    case PE_BEGIN_PARAMS:
-        return "Params on BEGIN field";
-    case PE_ENTRY_MULTIGROUP:
-        return "Multiple group levels in property name";
-    case PE_FINISHED_EARLY:
-        return "VCard not completed";
-    case PE_KEY_EOF:
-        return "End of data while parsing parameter key";
-    case PE_KEY_EOL:
-        return "End of line while parsing parameter key";
-    case PE_MISMATCHED_CARD:
-        return "Closed a different card name than opened";
-    case PE_NAME_EOF:
-        return "End of data while parsing entry name";
-    case PE_NAME_EOL:
-        return "End of line while parsing entry name";
-    case PE_PARAMVALUE_EOF:
-        return "End of data while parsing parameter value";
-    case PE_PARAMVALUE_EOL:
-        return "End of line while parsing parameter value";
-    case PE_QSTRING_EOF:
-        return "End of data while parsing quoted value";
-    case PE_QSTRING_EOL:
-        return "End of line while parsing quoted value";
+    for (; *s; s++)
+        buf_putc(buf, (*s >= 'a' && *s <= 'z') ? *s - ('a' - 'A') : *s);
+}
+
+static void _write_value(struct buf *buf, const char *s)
+{
+    if (!s) return;
+    for (; *s; s++) {
+        switch (*s) {
+        case '\\':
+        case ',':
+        case ';':
+            buf_putc(buf, '\\');
+            buf_putc(buf, *s);
+            break;
+        case '\n':
+            buf_putn(buf, "\\n", 2);
+            break;
+        default:
+            buf_putc(buf, *s);
+            break;
+        }
     }
-    return "Unknown error";
 }
 
-#ifdef DEBUG
-static int _dump_card(struct vparse_card *card)
+/* RFC 6868 encoding, quoted if it contains anything which isn't
+ * a SAFE-CHAR (RFC 6350 section 3.3) */
+static void _write_paramvalue(struct buf *buf, const char *name, const char *s)
 {
-    struct vparse_entry *entry;
-    struct vparse_param *param;
-    struct vparse_card *sub;
+    int quote = s[strcspn(s, ";:,")] != '\0';
+    int islabel = !strcmp(name, "label");
 
-    printf("begin:%s\n", card->type);
-    for (entry = card->properties; entry; entry = entry->next) {
-        printf("%s", entry->name);
-        for (param = entry->params; param; param = param->next)
-            printf(";%s=%s", param->name, param->value);
-        if (entry->multivalue)
-            printf(":multivalue\n");
-        else
-            printf(":%s\n", entry->v.value);
+    if (quote) buf_putc(buf, '"');
+    for (; *s; s++) {
+        switch (*s) {
+        case '\n':
+            if (islabel)
+                buf_putn(buf, "\\N", 2);
+            else
+                buf_putn(buf, "^n", 2);
+            break;
+        case '^':
+            buf_putn(buf, "^^", 2);
+            break;
+        case '"':
+            buf_putn(buf, "^'", 2);
+            break;
+        default:
+            buf_putc(buf, *s);
+            break;
+        }
     }
-    for (sub = card->objects; sub; sub = sub->next)
-        _dump_card(sub);
-    printf("end:%s\n", card->type);
+    if (quote) buf_putc(buf, '"');
 }
 
-static int _dump(struct vparse_card *card)
+/* fold to FOLDLEN octets, never splitting a UTF-8 character or
+ * ending a line on a backslash */
+static void _write_folded(struct buf *buf, const char *s, size_t len, const char *eol)
 {
-    _dump_card(card->objects);
+    size_t limit = FOLDLEN;
+
+    while (len > limit) {
+        size_t n = limit;
+        while (n > 1 && (((unsigned char)s[n] & 0xc0) == 0x80 || s[n-1] == '\\'))
+            n--;
+        buf_putn(buf, s, n);
+        buf_puts(buf, eol);
+        buf_putc(buf, ' ');
+        s += n;
+        len -= n;
+        limit = FOLDLEN - 1;
+    }
+    buf_putn(buf, s, len);
+    buf_puts(buf, eol);
 }
 
-int main(int argv, const char **argc)
+static void _write_param(struct buf *line, const struct vparse_param *param)
 {
-    const char *fname = argc[1];
-    struct stat sbuf;
-    int fd = open(fname, O_RDONLY);
-    struct vparse_state parser;
-    char *data;
-    int r;
+    buf_putc(line, ';');
+    _write_uc(line, param->name);
+    if (param->value) {
+        buf_putc(line, '=');
+        _write_paramvalue(line, param->name, param->value);
+    }
+}
 
-    memset(&parser, 0, sizeof(struct vparse_state));
+static void _write_entryvalue(struct buf *line, const struct vparse_entry *entry)
+{
+    buf_putc(line, ':');
+
+    if (entry->multivalue) {
+        const struct vparse_list *item;
+        for (item = entry->v.values; item; item = item->next) {
+            if (item != entry->v.values)
+                buf_putc(line, ';');
+            _write_value(line, item->s);
+        }
+    }
+    else {
+        _write_value(line, entry->v.value);
+    }
+}
 
-    fstat(fd, &sbuf);
-    data = malloc(sbuf.st_size+1);
+static void _write_entry(struct buf *buf, struct buf *line,
+                         const struct vparse_entry *entry, const char *eol)
+{
+    const struct vparse_param *param;
 
-    read(fd, data, sbuf.st_size);
-    data[sbuf.st_size] = '\0';
+    line->len = 0;
 
-    parser.base = data;
-    r = vparse_parse(&parser);
-    if (r) {
-        struct vparse_errorpos pos;
-        vparse_fillpos(&parser, &pos);
-        printf("error %s at line %d char %d: %.*s ... %.*s <--- (started at line %d char %d)\n",
-              vparse_errstr(r), pos.errorline, pos.errorchar,
-              20, parser.base + pos.startpos,
-              20, parser.base + pos.errorpos - 20,
-              pos.startline, pos.startchar);
-        return 1;
+    if (entry->group) {
+        _write_uc(line, entry->group);
+        buf_putc(line, '.');
     }
+    _write_uc(line, entry->name);
 
-    _dump(parser.card);
+    for (param = entry->params; param; param = param->next)
+        _write_param(line, param);
 
-    vparse_free(&parser);
+    _write_entryvalue(line, entry);
 
-    return 0;
+    _write_folded(buf, line->s, line->len, eol);
+}
+
+static void _write_card(struct buf *buf, struct buf *line,
+                        const struct vparse_card *card, const char *eol)
+{
+    const struct vparse_entry *entry;
+    const struct vparse_card *sub;
+
+    if (card->type) {
+        buf_puts(buf, "BEGIN:");
+        _write_uc(buf, card->type);
+        buf_puts(buf, eol);
+    }
+
+    for (entry = card->properties; entry; entry = entry->next)
+        _write_entry(buf, line, entry, eol);
+
+    for (sub = card->objects; sub; sub = sub->next)
+        _write_card(buf, line, sub, eol);
+
+    if (card->type) {
+        buf_puts(buf, "END:");
+        _write_uc(buf, card->type);
+        buf_puts(buf, eol);
+    }
+}
+
+/* CANONICAL OUTPUT
+ *
+ * The same text _write_card produces, but with everything that the
+ * parser throws away made deterministic: params sorted by name and
+ * value, properties sorted by name, group and then their full text
+ * (VERSION stays first as RFC 6350 requires), sub cards sorted by
+ * their canonical text, CRLF line endings and FOLDLEN folding.
+ * Quoting and escaping are whatever _write_* always does. */
+
+#define CANON_EOL "\r\n"
+
+struct canon_line {
+    const char *name;
+    const char *group;
+    char *s;
+    size_t len;
+};
+
+static int _canon_paramcmp(const void *a, const void *b)
+{
+    const struct vparse_param *pa = *(const struct vparse_param **)a;
+    const struct vparse_param *pb = *(const struct vparse_param **)b;
+    int r = strcmp(pa->name, pb->name);
+
+    if (r) return r;
+    if (!pa->value || !pb->value)
+        return !!pa->value - !!pb->value;
+    return strcmp(pa->value, pb->value);
+}
+
+static int _canon_bytescmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (r) return r;
+    return (alen > blen) - (alen < blen);
+}
+
+static int _canon_linecmp(const void *a, const void *b)
+{
+    const struct canon_line *la = a;
+    const struct canon_line *lb = b;
+    int va = !strcmp(la->name, "version");
+    int vb = !strcmp(lb->name, "version");
+    int r;
+
+    if (va != vb) return vb - va;
+    r = strcmp(la->name, lb->name);
+    if (r) return r;
+    if (!la->group || !lb->group)
+        r = !!la->group - !!lb->group;
+    else
+        r = strcmp(la->group, lb->group);
+    if (r) return r;
+    return _canon_bytescmp(la->s, la->len, lb->s, lb->len);
+}
+
+static int _canon_cardcmp(const void *a, const void *b)
+{
+    const struct buf *ba = a;
+    const struct buf *bb = b;
+
+    return _canon_bytescmp(ba->s, ba->len, bb->s, bb->len);
+}
+
+static void _canon_entry(struct buf *line, const struct vparse_entry *entry,
+                         const struct vparse_param ***params, size_t *alloc)
+{
+    const struct vparse_param *param;
+    size_t n = 0;
+    size_t i;
+
+    line->len = 0;
+
+    if (entry->group) {
+        _write_uc(line, entry->group);
+        buf_putc(line, '.');
+    }
+    _write_uc(line, entry->name);
+
+    for (param = entry->params; param; param = param->next) {
+        if (n == *alloc) {
+            *alloc = *alloc ? *alloc * 2 : 8;
+            *params = realloc(*params, *alloc * sizeof(**params));
+        }
+        (*params)[n++] = param;
+    }
+    if (n > 1) qsort(*params, n, sizeof(**params), _canon_paramcmp);
+    for (i = 0; i < n; i++)
+        _write_param(line, (*params)[i]);
+
+    _write_entryvalue(line, entry);
+}
+
+static void _canon_card(struct buf *buf, const struct vparse_card *card)
+{
+    const struct vparse_entry *entry;
+    const struct vparse_card *sub;
+    const struct vparse_param **params = NULL;
+    struct canon_line *lines = NULL;
+    struct buf *subs = NULL;
+    struct buf line = BUF_INITIALIZER;
+    size_t palloc = 0;
+    size_t n = 0;
+    size_t i;
+
+    for (entry = card->properties; entry; entry = entry->next) n++;
+    if (n) lines = malloc(n * sizeof(struct canon_line));
+
+    for (n = 0, entry = card->properties; entry; entry = entry->next, n++) {
+        _canon_entry(&line, entry, &params, &palloc);
+        lines[n].name = entry->name;
+        lines[n].group = entry->group;
+        lines[n].len = line.len;
+        lines[n].s = malloc(line.len ? line.len : 1);
+        memcpy(lines[n].s, line.s, line.len);
+    }
+    if (n > 1) qsort(lines, n, sizeof(struct canon_line), _canon_linecmp);
+
+    if (card->type) {
+        buf_puts(buf, "BEGIN:");
+        _write_uc(buf, card->type);
+        buf_puts(buf, CANON_EOL);
+    }
+
+    for (i = 0; i < n; i++) {
+        _write_folded(buf, lines[i].s, lines[i].len, CANON_EOL);
+        free(lines[i].s);
+    }
+
+    for (n = 0, sub = card->objects; sub; sub = sub->next) n++;
+    if (n) subs = calloc(n, sizeof(struct buf));
+    for (n = 0, sub = card->objects; sub; sub = sub->next, n++)
+        _canon_card(&subs[n], sub);
+    if (n > 1) qsort(subs, n, sizeof(struct buf), _canon_cardcmp);
+    for (i = 0; i < n; i++) {
+        buf_putn(buf, subs[i].s, subs[i].len);
+        buf_free(&subs[i]);
+    }
+
+    if (card->type) {
+        buf_puts(buf, "END:");
+        _write_uc(buf, card->type);
+        buf_puts(buf, CANON_EOL);
+    }
+
+    free(subs);
+    free(lines);
+    free(params);
+    buf_free(&line);
+}
+
+/* JCARD OUTPUT (RFC 7095)
+ *
+ * Each entry becomes [name, {params}, type, value], with the group as
+ * a "group" param and structured values as arrays.  Sub cards go in a
+ * third element like jCal components.  The value type comes from the
+ * VALUE param, then the caller's table, then the defaults below. */
+
+static const char *const _jcard_types[] = {
+    "anniversary", "date-and-or-time",
+    "bday", "date-and-or-time",
+    "caladruri", "uri",
+    "caluri", "uri",
+    "fburl", "uri",
+    "geo", "uri",
+    "impp", "uri",
+    "key", "uri",
+    "lang", "language-tag",
+    "logo", "uri",
+    "member", "uri",
+    "photo", "uri",
+    "related", "uri",
+    "rev", "timestamp",
+    "sound", "uri",
+    "source", "uri",
+    "uid", "uri",
+    "url", "uri",
+    NULL
+};
+
+static void _json_string(struct buf *buf, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    if (!s) {
+        buf_puts(buf, "null");
+        return;
+    }
+
+    buf_putc(buf, '"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+        switch (c) {
+        case '"':
+        case '\\':
+            buf_putc(buf, '\\');
+            buf_putc(buf, c);
+            break;
+        case '\n':
+            buf_putn(buf, "\\n", 2);
+            break;
+        case '\r':
+            buf_putn(buf, "\\r", 2);
+            break;
+        case '\t':
+            buf_putn(buf, "\\t", 2);
+            break;
+        default:
+            if (c < 0x20) {
+                buf_putn(buf, "\\u00", 4);
+                buf_putc(buf, hex[c >> 4]);
+                buf_putc(buf, hex[c & 0xf]);
+            }
+            else {
+                buf_putc(buf, c);
+            }
+            break;
+        }
+    }
+    buf_putc(buf, '"');
+}
+
+static const char *_jcard_lookup(const char *const *types, const char *name)
+{
+    for (; types && *types; types += 2)
+        if (!strcmp(types[0], name))
+            return types[1];
+    return NULL;
+}
+
+static const char *_jcard_type(const struct vparse_entry *entry, const char *const *types)
+{
+    const struct vparse_param *param;
+    const char *type;
+
+    for (param = entry->params; param; param = param->next) {
+        if (!strcmp(param->name, "value") && param->value)
+            return param->value;
+    }
+
+    if ((type = _jcard_lookup(types, entry->name)))
+        return type;
+
+    /* vCard 3 inline data */
+    for (param = entry->params; param; param = param->next) {
+        if (!strcmp(param->name, "encoding") && param->value
+         && (!strcasecmp(param->value, "b") || !strcasecmp(param->value, "base64")))
+            return "binary";
+    }
+
+    if ((type = _jcard_lookup(_jcard_types, entry->name)))
+        return type;
+
+    if (!strncmp(entry->name, "x-", 2))
+        return "unknown";
+
+    return "text";
+}
+
+static int _json_isnumber(const char *s, int isfloat)
+{
+    const char *p = s;
+
+    if (*p == '-') p++;
+    if (*p < '0' || *p > '9') return 0;
+    while (*p >= '0' && *p <= '9') p++;
+    if (isfloat && *p == '.') {
+        p++;
+        if (*p < '0' || *p > '9') return 0;
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    return *p == '\0';
+}
+
+static void _jcard_value(struct buf *buf, const char *s, const char *type)
+{
+    int isint = !strcasecmp(type, "integer");
+
+    if (s && (isint || !strcasecmp(type, "float")) && _json_isnumber(s, !isint))
+        buf_puts(buf, s);
+    else
+        _json_string(buf, s);
+}
+
+static void _jcard_params(struct buf *buf, const struct vparse_entry *entry)
+{
+    const struct vparse_param *param, *other;
+    int first = 1;
+
+    buf_putc(buf, '{');
+
+    if (entry->group) {
+        buf_puts(buf, "\"group\":");
+        _json_string(buf, entry->group);
+        first = 0;
+    }
+
+    for (param = entry->params; param; param = param->next) {
+        int count = 0;
+
+        if (!strcmp(param->name, "value")) continue;
+
+        /* repeats were written with the first one */
+        for (other = entry->params; other != param; other = other->next)
+            if (!strcmp(other->name, param->name)) break;
+        if (other != param) continue;
+
+        for (other = param; other; other = other->next)
+            if (!strcmp(other->name, param->name)) count++;
+
+        if (!first) buf_putc(buf, ',');
+        first = 0;
+        _json_string(buf, param->name);
+        buf_putc(buf, ':');
+
+        if (count == 1) {
+            _json_string(buf, param->value);
+            continue;
+        }
+
+        buf_putc(buf, '[');
+        for (other = param; other; other = other->next) {
+            if (strcmp(other->name, param->name)) continue;
+            if (other != param) buf_putc(buf, ',');
+            _json_string(buf, other->value);
+        }
+        buf_putc(buf, ']');
+    }
+
+    buf_putc(buf, '}');
+}
+
+static void _jcard_entry(struct buf *buf, const struct vparse_entry *entry,
+                         const char *const *types)
+{
+    const char *type = _jcard_type(entry, types);
+    size_t start;
+
+    buf_putc(buf, '[');
+    _json_string(buf, entry->name);
+    buf_putc(buf, ',');
+    _jcard_params(buf, entry);
+    buf_putc(buf, ',');
+    /* value types are lowercase in jCard, and nothing in a JSON
+     * escape is uppercase */
+    start = buf->len;
+    _json_string(buf, type);
+    for (; start < buf->len; start++)
+        if (buf->s[start] >= 'A' && buf->s[start] <= 'Z')
+            buf->s[start] += 'a' - 'A';
+    buf_putc(buf, ',');
+
+    if (entry->multivalue) {
+        const struct vparse_list *item;
+        buf_putc(buf, '[');
+        for (item = entry->v.values; item; item = item->next) {
+            if (item != entry->v.values) buf_putc(buf, ',');
+            _jcard_value(buf, item->s, type);
+        }
+        buf_putc(buf, ']');
+    }
+    else {
+        _jcard_value(buf, entry->v.value, type);
+    }
+
+    buf_putc(buf, ']');
+}
+
+static void _jcard_card(struct buf *buf, const struct vparse_card *card,
+                        const char *const *types)
+{
+    const struct vparse_entry *entry;
+    const struct vparse_card *sub;
+
+    buf_putc(buf, '[');
+    _json_string(buf, card->type);
+    buf_puts(buf, ",[");
+    for (entry = card->properties; entry; entry = entry->next) {
+        if (entry != card->properties) buf_putc(buf, ',');
+        _jcard_entry(buf, entry, types);
+    }
+    buf_putc(buf, ']');
+
+    if (card->objects) {
+        buf_puts(buf, ",[");
+        for (sub = card->objects; sub; sub = sub->next) {
+            if (sub != card->objects) buf_putc(buf, ',');
+            _jcard_card(buf, sub, types);
+        }
+        buf_putc(buf, ']');
+    }
+
+    buf_putc(buf, ']');
+}
+
+/* JCARD INPUT
+ *
+ * JSON is read into a small tree of nodes first, then converted into
+ * the same card tree the text parser makes, using the multival and
+ * multiparam lists the same way.  A VALUE param is only added where
+ * the type isn't the one the jCard writer would pick anyway, so text
+ * and jCard round trip through each other. */
+
+#define JSON_MAXDEPTH 64
+
+enum json_type {
+    JSON_NULL,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+};
+
+struct json_node {
+    int type;
+    int pos;
+    char *s;    /* STRING and NUMBER */
+    char *key;  /* members of an OBJECT */
+    struct json_node *child;
+    struct json_node *next;
+};
+
+static void _json_free(struct json_node *node)
+{
+    struct json_node *next;
+
+    for (; node; node = next) {
+        next = node->next;
+        free(node->s);
+        free(node->key);
+        _json_free(node->child);
+        free(node);
+    }
+}
+
+static void _json_ws(struct vparse_state *state)
+{
+    while (*state->p == ' ' || *state->p == '\t' || *state->p == '\r' || *state->p == '\n')
+        INC(1);
+}
+
+static int _json_hex4(const char *p, unsigned *out)
+{
+    unsigned v = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return 0;
+    }
+
+    *out = v;
+    return 1;
+}
+
+static void _json_utf8(struct buf *buf, unsigned c)
+{
+    if (c < 0x80) {
+        buf_putc(buf, c);
+    }
+    else if (c < 0x800) {
+        buf_putc(buf, 0xc0 | (c >> 6));
+        buf_putc(buf, 0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000) {
+        buf_putc(buf, 0xe0 | (c >> 12));
+        buf_putc(buf, 0x80 | ((c >> 6) & 0x3f));
+        buf_putc(buf, 0x80 | (c & 0x3f));
+    }
+    else {
+        buf_putc(buf, 0xf0 | (c >> 18));
+        buf_putc(buf, 0x80 | ((c >> 12) & 0x3f));
+        buf_putc(buf, 0x80 | ((c >> 6) & 0x3f));
+        buf_putc(buf, 0x80 | (c & 0x3f));
+    }
+}
+
+/* state->p is on the opening quote, the string is left on state->buf */
+static int _json_parse_string(struct vparse_state *state)
+{
+    state->buf.len = 0;
+    INC(1);
+
+    while (*state->p != '"') {
+        unsigned c, lo;
+
+        switch (*state->p) {
+        case '\0':
+            return PE_JSON_SYNTAX;
+
+        case '\\':
+            INC(1);
+            switch (*state->p) {
+            case '"':  PUTC('"');  break;
+            case '\\': PUTC('\\'); break;
+            case '/':  PUTC('/');  break;
+            case 'b':  PUTC('\b'); break;
+            case 'f':  PUTC('\f'); break;
+            case 'n':  PUTC('\n'); break;
+            case 'r':  PUTC('\r'); break;
+            case 't':  PUTC('\t'); break;
+            case 'u':
+                if (!_json_hex4(state->p + 1, &c)) return PE_JSON_SYNTAX;
+                INC(4);
+                if (c >= 0xd800 && c < 0xdc00) {
+                    if (state->p[1] != '\\' || state->p[2] != 'u'
+                     || !_json_hex4(state->p + 3, &lo) || lo < 0xdc00 || lo >= 0xe000)
+                        return PE_JSON_SYNTAX;
+                    INC(6);
+                    c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                else if (c >= 0xdc00 && c < 0xe000) {
+                    return PE_JSON_SYNTAX;
+                }
+                else if (!c) {
+                    /* would cut the C string short */
+                    return PE_JSON_SYNTAX;
+                }
+                _json_utf8(&state->buf, c);
+                break;
+            default:
+                return PE_JSON_SYNTAX;
+            }
+            INC(1);
+            break;
+
+        default:
+            if ((unsigned char) *state->p < 0x20) return PE_JSON_SYNTAX;
+            PUTRUN(&_class_jstring);
+            break;
+        }
+    }
+
+    INC(1);
+    return 0;
+}
+
+static int _json_parse_value(struct vparse_state *state, struct json_node **nodep, int depth)
+{
+    struct json_node *node;
+    struct json_node **tail;
+    int r;
+
+    if (depth > JSON_MAXDEPTH) return PE_JSON_SYNTAX;
+
+    _json_ws(state);
+    NOTESTART();
+
+    MAKE(node, json_node);
+    node->pos = state->p - state->base;
+    *nodep = node;
+
+    switch (*state->p) {
+    case '"':
+        node->type = JSON_STRING;
+        r = _json_parse_string(state);
+        if (r) return r;
+        node->s = buf_dup_cstring(&state->buf);
+        return 0;
+
+    case '[':
+    case '{':
+        node->type = *state->p == '[' ? JSON_ARRAY : JSON_OBJECT;
+        INC(1);
+        _json_ws(state);
+        tail = &node->child;
+        if (*state->p == (node->type == JSON_ARRAY ? ']' : '}')) {
+            INC(1);
+            return 0;
+        }
+        for (;;) {
+            char *key = NULL;
+            if (node->type == JSON_OBJECT) {
+                _json_ws(state);
+                if (*state->p != '"') return PE_JSON_SYNTAX;
+                r = _json_parse_string(state);
+                if (r) return r;
+                key = buf_dup_cstring(&state->buf);
+                _json_ws(state);
+                if (*state->p != ':') {
+                    free(key);
+                    return PE_JSON_SYNTAX;
+                }
+                INC(1);
+            }
+            r = _json_parse_value(state, tail, depth + 1);
+            if (*tail) (*tail)->key = key;
+            else free(key);
+            if (r) return r;
+            tail = &(*tail)->next;
+            _json_ws(state);
+            if (*state->p == ',') {
+                INC(1);
+                continue;
+            }
+            if (*state->p != (node->type == JSON_ARRAY ? ']' : '}'))
+                return PE_JSON_SYNTAX;
+            INC(1);
+            return 0;
+        }
+
+    case 't':
+        if (strncmp(state->p, "true", 4)) return PE_JSON_SYNTAX;
+        node->type = JSON_TRUE;
+        INC(4);
+        return 0;
+
+    case 'f':
+        if (strncmp(state->p, "false", 5)) return PE_JSON_SYNTAX;
+        node->type = JSON_FALSE;
+        INC(5);
+        return 0;
+
+    case 'n':
+        if (strncmp(state->p, "null", 4)) return PE_JSON_SYNTAX;
+        node->type = JSON_NULL;
+        INC(4);
+        return 0;
+
+    default:
+        if (*state->p != '-' && (*state->p < '0' || *state->p > '9'))
+            return PE_JSON_SYNTAX;
+        node->type = JSON_NUMBER;
+        state->buf.len = 0;
+        while (*state->p && strchr("+-.0123456789eE", *state->p)) {
+            PUTC(*state->p);
+            INC(1);
+        }
+        node->s = buf_dup_cstring(&state->buf);
+        return 0;
+    }
+}
+
+static int _jcard_inlist(const struct vparse_list *list, const char *name)
+{
+    for (; list; list = list->next)
+        if (!strcmpsafe(name, list->s))
+            return 1;
+    return 0;
+}
+
+/* a scalar as a string, or NULL for anything else */
+static const char *_jcard_scalarstr(const struct json_node *node)
+{
+    switch (node->type) {
+    case JSON_STRING:
+    case JSON_NUMBER:
+        return node->s;
+    case JSON_TRUE:
+        return "TRUE";
+    case JSON_FALSE:
+        return "FALSE";
+    case JSON_NULL:
+        return "";
+    }
+    return NULL;
+}
+
+static char *_jcard_scalar(struct vparse_state *state, const struct json_node *node)
+{
+    const char *s = _jcard_scalarstr(node);
+    return s ? STRDUP(s) : NULL;
+}
+
+/* an array of scalars joined with sep */
+static char *_jcard_join(struct vparse_state *state, const struct json_node *node, char sep)
+{
+    struct buf *buf = &state->buf;
+
+    buf->len = 0;
+    for (; node; node = node->next) {
+        const char *s = _jcard_scalarstr(node);
+        if (!s) {
+            state->p = state->base + node->pos;
+            return NULL;
+        }
+        buf_puts(buf, s);
+        if (node->next) buf_putc(buf, sep);
+    }
+
+    return BUFDUP();
+}
+
+static int _jcard_addparam(struct vparse_state *state, struct vparse_param ***tailp,
+                           const char *name, char *value)
+{
+    struct vparse_param *param;
+
+    if (!value) return PE_JCARD_FORMAT;
+
+    NEW(param, vparse_param);
+    param->name = STRDUP(name);
+    param->value = value;
+    **tailp = param;
+    *tailp = &param->next;
+
+    return 0;
+}
+
+static int _jcard_read_entry(struct vparse_state *state, const struct json_node *node,
+                             struct vparse_entry *entry)
+{
+    const struct json_node *name, *params, *type, *value, *item;
+    struct vparse_param **ptail = &entry->params;
+    int r;
+
+    state->p = state->base + node->pos;
+
+    name = node->child;
+    params = name ? name->next : NULL;
+    type = params ? params->next : NULL;
+    value = type ? type->next : NULL;
+    if (node->type != JSON_ARRAY || !value || name->type != JSON_STRING
+     || params->type != JSON_OBJECT || type->type != JSON_STRING)
+        return PE_JCARD_FORMAT;
+
+    entry->srcpos = node->pos;
+    entry->name = STRDUP(name->s);
+    LC(entry->name);
+
+    for (item = params->child; item; item = item->next) {
+        char *pname = strdup(item->key);
+        LC(pname);
+
+        if (!strcmp(pname, "group")) {
+            entry->group = _jcard_scalar(state, item);
+            if (entry->group) LC(entry->group);
+            free(pname);
+            state->p = state->base + item->pos;
+            if (!entry->group) return PE_JCARD_FORMAT;
+            continue;
+        }
+
+        state->p = state->base + item->pos;
+        if (item->type != JSON_ARRAY)
+            r = _jcard_addparam(state, &ptail, pname, _jcard_scalar(state, item));
+        else if (_jcard_inlist(state->multiparam, pname)) {
+            const struct json_node *pv;
+            r = 0;
+            for (pv = item->child; pv && !r; pv = pv->next)
+                r = _jcard_addparam(state, &ptail, pname, _jcard_scalar(state, pv));
+        }
+        else
+            r = _jcard_addparam(state, &ptail, pname, _jcard_join(state, item->child, ','));
+        free(pname);
+        if (r) return r;
+    }
+
+    /* only say what the writer wouldn't guess */
+    state->p = state->base + type->pos;
+    if (strcasecmp(type->s, _jcard_type(entry, NULL))) {
+        char *vtype = STRDUP(type->s);
+        LC(vtype);
+        r = _jcard_addparam(state, &ptail, "value", vtype);
+        if (r) return r;
+    }
+
+    state->p = state->base + value->pos;
+    if (_jcard_inlist(state->multival, entry->name)) {
+        struct vparse_list **vtail = &entry->v.values;
+        entry->multivalue = 1;
+        item = value->type == JSON_ARRAY && !value->next ? value->child : value;
+        for (; item; item = item->next) {
+            char *s = item->type == JSON_ARRAY ? _jcard_join(state, item->child, ',')
+                                               : _jcard_scalar(state, item);
+            if (!s) return PE_JCARD_FORMAT;
+            NEW(*vtail, vparse_list);
+            (*vtail)->s = s;
+            vtail = &(*vtail)->next;
+        }
+    }
+    else if (value->type == JSON_ARRAY) {
+        if (value->next) return PE_JCARD_FORMAT;
+        entry->v.value = _jcard_join(state, value->child, ';');
+    }
+    else {
+        entry->v.value = _jcard_join(state, value, ',');
+    }
+
+    if (!entry->multivalue && !entry->v.value)
+        return PE_JCARD_FORMAT;
+
+    return 0;
+}
+
+static int _jcard_read_card(struct vparse_state *state, const struct json_node *node,
+                            struct vparse_card *card)
+{
+    const struct json_node *type, *props, *subs, *item;
+    struct vparse_entry **etail = &card->properties;
+    struct vparse_card **ctail = &card->objects;
+    int r;
+
+    state->p = state->base + node->pos;
+
+    type = node->type == JSON_ARRAY ? node->child : NULL;
+    props = type ? type->next : NULL;
+    subs = props ? props->next : NULL;
+    if (!props || type->type != JSON_STRING || props->type != JSON_ARRAY
+     || (subs && (subs->type != JSON_ARRAY || subs->next)))
+        return PE_JCARD_FORMAT;
+
+    card->type = STRDUP(type->s);
+    LC(card->type);
+
+    for (item = props->child; item; item = item->next) {
+        struct vparse_entry *entry;
+        uint64_t h[2];
+
+        NEW(entry, vparse_entry);
+        *etail = entry;
+        etail = &entry->next;
+        r = _jcard_read_entry(state, item, entry);
+        if (r) return r;
+        if (state->fingerprint) {
+            _fp_entry(&state->buf, entry, h);
+            _fp_add(card->fingerprint, h);
+        }
+    }
+
+    for (item = subs ? subs->child : NULL; item; item = item->next) {
+        struct vparse_card *sub;
+        NEW(sub, vparse_card);
+        *ctail = sub;
+        ctail = &sub->next;
+        r = _jcard_read_card(state, item, sub);
+        if (r) return r;
+        if (state->fingerprint) _fp_add(card->fingerprint, sub->fingerprint);
+    }
+
+    if (state->fingerprint) _fp_finish(&state->buf, card);
+    if (state->index) card->index = _index_build(card, &state->arena);
+
+    return 0;
+}
+
+/* HASH JSON
+ *
+ * The structure VCardFast.xs builds in perl for vcard2hash, written
+ * straight out as JSON: properties grouped by name in the order each
+ * name first appears, and params grouped the same way, with bare
+ * params going under "type" just like _entry2perl does. */
+
+static void _hjson_key(struct buf *buf, const char *key, int *first)
+{
+    if (!*first) buf_putc(buf, ',');
+    *first = 0;
+    _json_string(buf, key);
+    buf_putc(buf, ':');
+}
+
+static const char *_hjson_paramkey(const struct vparse_param *param)
+{
+    return param->value ? param->name : "type";
+}
+
+static void _hjson_params(struct buf *buf, const struct vparse_param *params)
+{
+    const struct vparse_param *param, *other;
+    int first = 1;
+
+    buf_putc(buf, '{');
+    for (param = params; param; param = param->next) {
+        const char *key = _hjson_paramkey(param);
+        int firstval = 1;
+
+        for (other = params; other != param; other = other->next)
+            if (!strcmp(_hjson_paramkey(other), key)) break;
+        if (other != param) continue;
+
+        _hjson_key(buf, key, &first);
+        buf_putc(buf, '[');
+        for (other = param; other; other = other->next) {
+            if (strcmp(_hjson_paramkey(other), key)) continue;
+            if (!firstval) buf_putc(buf, ',');
+            firstval = 0;
+            _json_string(buf, other->value ? other->value : other->name);
+        }
+        buf_putc(buf, ']');
+    }
+    buf_putc(buf, '}');
+}
+
+static void _hjson_entry(struct buf *buf, const struct vparse_entry *entry,
+                         struct vparse_state *lines)
+{
+    int first = 1;
+
+    buf_putc(buf, '{');
+
+    if (entry->group) {
+        _hjson_key(buf, "group", &first);
+        _json_string(buf, entry->group);
+    }
+
+    _hjson_key(buf, "name", &first);
+    _json_string(buf, entry->name);
+
+    if (lines) {
+        char num[16];
+        int line, col;
+        vparse_linepos(lines, entry->srcpos, &line, &col);
+        snprintf(num, sizeof(num), "%d", line);
+        _hjson_key(buf, "line", &first);
+        buf_puts(buf, num);
+    }
+
+    if (entry->multivalue) {
+        const struct vparse_list *item;
+        _hjson_key(buf, "values", &first);
+        buf_putc(buf, '[');
+        for (item = entry->v.values; item; item = item->next) {
+            if (item != entry->v.values) buf_putc(buf, ',');
+            _json_string(buf, item->s);
+        }
+        buf_putc(buf, ']');
+    }
+    else {
+        _hjson_key(buf, "value", &first);
+        _json_string(buf, entry->v.value);
+    }
+
+    if (entry->params) {
+        _hjson_key(buf, "params", &first);
+        _hjson_params(buf, entry->params);
+    }
+
+    buf_putc(buf, '}');
+}
+
+static void _hjson_card(struct buf *buf, const struct vparse_card *card,
+                        struct vparse_state *state, int flags)
+{
+    const struct vparse_entry *entry, *other;
+    const struct vparse_card *sub;
+    int first = 1;
+
+    buf_putc(buf, '{');
+
+    if (card->type) {
+        int firstname = 1;
+
+        _hjson_key(buf, "type", &first);
+        _json_string(buf, card->type);
+
+        /* each name once, at its first entry, through the index */
+        _hjson_key(buf, "properties", &first);
+        buf_putc(buf, '{');
+        for (entry = card->properties; entry; entry = entry->next) {
+            if (vparse_card_find(card, NULL, entry->name, NULL) != entry)
+                continue;
+
+            _hjson_key(buf, entry->name, &firstname);
+            buf_putc(buf, '[');
+            for (other = entry; other; other = vparse_card_find(card, NULL, entry->name, other)) {
+                if (other != entry) buf_putc(buf, ',');
+                _hjson_entry(buf, other, (flags & VPARSE_JSON_LINES) ? state : NULL);
+            }
+            buf_putc(buf, ']');
+        }
+        buf_putc(buf, '}');
+
+        if (flags & VPARSE_JSON_FINGERPRINT) {
+            char hex[33];
+            snprintf(hex, sizeof(hex), "%016llx%016llx",
+                     (unsigned long long) card->fingerprint[0],
+                     (unsigned long long) card->fingerprint[1]);
+            _hjson_key(buf, "fingerprint", &first);
+            _json_string(buf, hex);
+        }
+    }
+
+    if (card->objects) {
+        _hjson_key(buf, "objects", &first);
+        buf_putc(buf, '[');
+        for (sub = card->objects; sub; sub = sub->next) {
+            if (sub != card->objects) buf_putc(buf, ',');
+            _hjson_card(buf, sub, state, flags);
+        }
+        buf_putc(buf, ']');
+    }
+
+    if (!card->type && (flags & VPARSE_JSON_ERRORS)) {
+        const struct vparse_error *error;
+        char num[256];
+
+        _hjson_key(buf, "errors", &first);
+        buf_putc(buf, '[');
+        for (error = state->errors; error; error = error->next) {
+            if (error != state->errors) buf_putc(buf, ',');
+            snprintf(num, sizeof(num),
+                     "{\"code\":%d,\"error\":", error->code);
+            buf_puts(buf, num);
+            _json_string(buf, vparse_errstr(error->code));
+            snprintf(num, sizeof(num),
+                     ",\"startpos\":%d,\"startline\":%d,\"startchar\":%d"
+                     ",\"errorpos\":%d,\"errorline\":%d,\"errorchar\":%d"
+                     ",\"skipstart\":%d,\"skipend\":%d}",
+                     error->pos.startpos, error->pos.startline, error->pos.startchar,
+                     error->pos.errorpos, error->pos.errorline, error->pos.errorchar,
+                     error->skipstart, error->skipend);
+            buf_puts(buf, num);
+        }
+        buf_putc(buf, ']');
+    }
+
+    buf_putc(buf, '}');
+}
+
+/* BINARY FORMAT
+ *
+ * A relocatable snapshot of a parsed tree.  All numbers are 32 bit
+ * little endian.  After the header come fixed size records for every
+ * card, entry, param and multivalue item, then one string table.
+ * Strings are (offset, length) pairs into the string table, with offset
+ * BLOB_NULL for a NULL string.
+ *
+ *   header: "VCFB" version flags ncards nentries nparams nvalues strlen
+ *   card:   type firstentry nentries firstchild nchildren
+ *   entry:  group name multivalue value|(firstvalue nvalues)
+ *           firstparam nparams srcpos
+ *   param:  name value
+ *   value:  s
+ *
+ * Cards are stored breadth first from the (typeless) root, so the
+ * children of every card are consecutive, and every card's entries,
+ * every entry's params and values are consecutive too.  Each of those
+ * ranges must start where the previous one ended, which the loader
+ * checks - so a damaged blob can't make a node appear twice. */
+
+#define BLOB_MAGIC "VCFB"
+#define BLOB_VERSION 1
+#define BLOB_NULL 0xffffffffU
+#define BLOB_HEADERSIZE 32
+#define BLOB_CARDSIZE 24
+#define BLOB_ENTRYSIZE 40
+#define BLOB_PARAMSIZE 16
+#define BLOB_VALUESIZE 8
+
+static void _put32(struct buf *buf, unsigned int v)
+{
+    buf_ensure(buf, 4);
+    buf->s[buf->len++] = v & 0xff;
+    buf->s[buf->len++] = (v >> 8) & 0xff;
+    buf->s[buf->len++] = (v >> 16) & 0xff;
+    buf->s[buf->len++] = (v >> 24) & 0xff;
+}
+
+static void _set32(char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static unsigned int _get32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((unsigned int) u[3] << 24);
+}
+
+static void _putstr(struct buf *buf, struct buf *strs, const char *s)
+{
+    size_t len;
+
+    if (!s) {
+        _put32(buf, BLOB_NULL);
+        _put32(buf, 0);
+        return;
+    }
+
+    len = strlen(s);
+    _put32(buf, strs->len);
+    _put32(buf, len);
+    buf_putn(strs, s, len);
+}
+
+struct blob_counts {
+    unsigned int cards;
+    unsigned int entries;
+    unsigned int params;
+    unsigned int values;
+};
+
+static void _blob_count(const struct vparse_card *card, struct blob_counts *counts)
+{
+    const struct vparse_entry *entry;
+    const struct vparse_param *param;
+    const struct vparse_list *item;
+    const struct vparse_card *sub;
+
+    counts->cards++;
+    for (entry = card->properties; entry; entry = entry->next) {
+        counts->entries++;
+        for (param = entry->params; param; param = param->next)
+            counts->params++;
+        if (entry->multivalue)
+            for (item = entry->v.values; item; item = item->next)
+                counts->values++;
+    }
+    for (sub = card->objects; sub; sub = sub->next)
+        _blob_count(sub, counts);
+}
+
+static void _blob_write(struct buf *buf, const struct vparse_card *root,
+                        const struct blob_counts *counts, int flags)
+{
+    const struct vparse_card **queue = malloc(counts->cards * sizeof(struct vparse_card *));
+    const struct vparse_entry *entry;
+    const struct vparse_param *param;
+    const struct vparse_list *item;
+    const struct vparse_card *sub;
+    struct buf strs = BUF_INITIALIZER;
+    size_t start = buf->len;
+    unsigned int tail = 1, nentries = 0, nparams = 0, nvalues = 0;
+    unsigned int i, n;
+
+    buf_putn(buf, BLOB_MAGIC, 4);
+    _put32(buf, BLOB_VERSION);
+    _put32(buf, flags);
+    _put32(buf, counts->cards);
+    _put32(buf, counts->entries);
+    _put32(buf, counts->params);
+    _put32(buf, counts->values);
+    _put32(buf, 0); /* string table length, filled in at the end */
+
+    queue[0] = root;
+    for (i = 0; i < counts->cards; i++) {
+        const struct vparse_card *card = queue[i];
+        _putstr(buf, &strs, card->type);
+        for (n = 0, entry = card->properties; entry; entry = entry->next) n++;
+        _put32(buf, nentries);
+        _put32(buf, n);
+        nentries += n;
+        _put32(buf, tail);
+        for (n = 0, sub = card->objects; sub; sub = sub->next)
+            queue[tail + n++] = sub;
+        _put32(buf, n);
+        tail += n;
+    }
+
+    for (i = 0; i < counts->cards; i++) {
+        for (entry = queue[i]->properties; entry; entry = entry->next) {
+            _putstr(buf, &strs, entry->group);
+            _putstr(buf, &strs, entry->name);
+            _put32(buf, entry->multivalue);
+            if (entry->multivalue) {
+                for (n = 0, item = entry->v.values; item; item = item->next) n++;
+                _put32(buf, nvalues);
+                _put32(buf, n);
+                nvalues += n;
+            }
+            else {
+                _putstr(buf, &strs, entry->v.value);
+            }
+            for (n = 0, param = entry->params; param; param = param->next) n++;
+            _put32(buf, nparams);
+            _put32(buf, n);
+            nparams += n;
+            _put32(buf, entry->srcpos);
+        }
+    }
+
+    for (i = 0; i < counts->cards; i++) {
+        for (entry = queue[i]->properties; entry; entry = entry->next) {
+            for (param = entry->params; param; param = param->next) {
+                _putstr(buf, &strs, param->name);
+                _putstr(buf, &strs, param->value);
+            }
+        }
+    }
+
+    for (i = 0; i < counts->cards; i++) {
+        for (entry = queue[i]->properties; entry; entry = entry->next) {
+            if (!entry->multivalue) continue;
+            for (item = entry->v.values; item; item = item->next)
+                _putstr(buf, &strs, item->s);
+        }
+    }
+
+    _set32(buf->s + start + 28, strs.len);
+    buf_putn(buf, strs.s, strs.len);
+
+    buf_free(&strs);
+    free(queue);
+}
+
+struct blob_reader {
+    const char *data;
+    const char *strs;
+    unsigned int strlen;
+};
+
+/* returns -1 for a bad reference */
+static int _getstr(const struct blob_reader *blob, const char *p, char **sp)
+{
+    unsigned int off = _get32(p);
+    unsigned int len = _get32(p + 4);
+
+    *sp = NULL;
+    if (off == BLOB_NULL)
+        return 0;
+    if (off > blob->strlen || len > blob->strlen - off)
+        return -1;
+
+    *sp = malloc(len + 1);
+    memcpy(*sp, blob->strs + off, len);
+    (*sp)[len] = '\0';
+    return 0;
+}
+
+static int _blob_read(const char *data, size_t len, struct vparse_card **rootp)
+{
+    struct blob_reader blob;
+    struct vparse_card **cards = NULL;
+    const char *cardrec, *entryrec, *paramrec, *valuerec;
+    unsigned int ncards, nentries, nparams, nvalues;
+    unsigned int nextentry = 0, nextchild = 1, nextparam = 0, nextvalue = 0;
+    unsigned long long need;
+    unsigned int i, j, k;
+    int r = PE_BLOB_FORMAT;
+
+    *rootp = NULL;
+
+    if (len < BLOB_HEADERSIZE || memcmp(data, BLOB_MAGIC, 4))
+        return PE_BLOB_FORMAT;
+    if (_get32(data + 4) != BLOB_VERSION)
+        return PE_BLOB_VERSION;
+
+    ncards = _get32(data + 12);
+    nentries = _get32(data + 16);
+    nparams = _get32(data + 20);
+    nvalues = _get32(data + 24);
+    blob.strlen = _get32(data + 28);
+
+    need = (unsigned long long) BLOB_HEADERSIZE
+         + (unsigned long long) ncards * BLOB_CARDSIZE
+         + (unsigned long long) nentries * BLOB_ENTRYSIZE
+         + (unsigned long long) nparams * BLOB_PARAMSIZE
+         + (unsigned long long) nvalues * BLOB_VALUESIZE
+         + blob.strlen;
+    if (!ncards || need != len)
+        return PE_BLOB_FORMAT;
+
+    cardrec = data + BLOB_HEADERSIZE;
+    entryrec = cardrec + ncards * BLOB_CARDSIZE;
+    paramrec = entryrec + nentries * BLOB_ENTRYSIZE;
+    valuerec = paramrec + nparams * BLOB_PARAMSIZE;
+    blob.data = data;
+    blob.strs = valuerec + nvalues * BLOB_VALUESIZE;
+
+    /* allocated in advance so children can be stitched to their
+     * parents - freed from the root, so all must be linked at once */
+    cards = malloc(ncards * sizeof(struct vparse_card *));
+    for (i = 0; i < ncards; i++) {
+        MAKE(cards[i], vparse_card);
+    }
+
+    for (i = 0; i < ncards; i++) {
+        struct vparse_card *card = cards[i];
+        const char *p = cardrec + i * BLOB_CARDSIZE;
+        struct vparse_entry **entryp = &card->properties;
+        struct vparse_card **subp = &card->objects;
+        unsigned int firstentry = _get32(p + 8);
+        unsigned int ne = _get32(p + 12);
+        unsigned int firstchild = _get32(p + 16);
+        unsigned int nc = _get32(p + 20);
+
+        /* every card but the root is a child of one before it */
+        if (i && i >= nextchild)
+            goto done;
+        if (firstentry != nextentry || ne > nentries - nextentry)
+            goto done;
+        if (firstchild != nextchild || nc > ncards - nextchild)
+            goto done;
+        nextentry += ne;
+        nextchild += nc;
+
+        for (j = 0; j < nc; j++) {
+            *subp = cards[firstchild + j];
+            subp = &(*subp)->next;
+        }
+
+        /* only the root is typeless */
+        if (_getstr(&blob, p, &card->type) || !i != !card->type)
+            goto done;
+
+        for (j = firstentry; j < firstentry + ne; j++) {
+            const char *e = entryrec + j * BLOB_ENTRYSIZE;
+            struct vparse_entry *entry;
+            struct vparse_param **paramp;
+            unsigned int firstparam = _get32(e + 28);
+            unsigned int np = _get32(e + 32);
+
+            MAKE(entry, vparse_entry);
+            *entryp = entry;
+            entryp = &entry->next;
+
+            if (_getstr(&blob, e, &entry->group)) goto done;
+            if (_getstr(&blob, e + 8, &entry->name) || !entry->name) goto done;
+            entry->srcpos = _get32(e + 36);
+
+            entry->multivalue = _get32(e + 16) ? 1 : 0;
+            if (entry->multivalue) {
+                struct vparse_list **valp = &entry->v.values;
+                unsigned int firstvalue = _get32(e + 20);
+                unsigned int nv = _get32(e + 24);
+                if (firstvalue != nextvalue || nv > nvalues - nextvalue)
+                    goto done;
+                nextvalue += nv;
+                for (k = firstvalue; k < firstvalue + nv; k++) {
+                    struct vparse_list *item;
+                    MAKE(item, vparse_list);
+                    *valp = item;
+                    valp = &item->next;
+                    if (_getstr(&blob, valuerec + k * BLOB_VALUESIZE, &item->s))
+                        goto done;
+                }
+            }
+            else {
+                if (_getstr(&blob, e + 20, &entry->v.value)) goto done;
+            }
+
+            if (firstparam != nextparam || np > nparams - nextparam)
+                goto done;
+            nextparam += np;
+            paramp = &entry->params;
+            for (k = firstparam; k < firstparam + np; k++) {
+                const char *q = paramrec + k * BLOB_PARAMSIZE;
+                struct vparse_param *param;
+                MAKE(param, vparse_param);
+                *paramp = param;
+                paramp = &param->next;
+                if (_getstr(&blob, q, &param->name) || !param->name) goto done;
+                if (_getstr(&blob, q + 8, &param->value)) goto done;
+            }
+        }
+    }
+
+    /* everything must have been used exactly once */
+    if (nextentry != nentries || nextchild != ncards
+     || nextparam != nparams || nextvalue != nvalues)
+        goto done;
+
+    r = 0;
+
+done:
+    /* the root card owns everything linked so far */
+    if (r) {
+        _free_card(cards[0]);
+        for (i = nextchild; i < ncards; i++)
+            _free_card(cards[i]);
+    }
+    else {
+        *rootp = cards[0];
+    }
+    free(cards);
+    return r;
+}
+
+/* FINGERPRINTS
+ *
+ * A hash of everything which matters in a card: lowercased group and
+ * name, params and decoded values.  Each entry is hashed separately and
+ * the entry hashes are summed, so property order doesn't matter - and
+ * the same goes for params within an entry.  Folding and line endings
+ * are gone by the time anything is hashed.  Sub cards are added to
+ * their parent like an entry.  Different tag bytes keep param, entry
+ * and card hashes apart. */
+
+static void _fp_add(uint64_t acc[2], const uint64_t h[2])
+{
+    acc[0] += h[0];
+    acc[1] += h[1];
+}
+
+static void _fp_putstr(struct buf *buf, const char *s)
+{
+    /* NULL and empty are different things */
+    if (s)
+        buf_putn(buf, s, strlen(s) + 1);
+    else
+        buf_putc(buf, '\1');
+}
+
+static void _fp_entry(struct buf *buf, const struct vparse_entry *entry, uint64_t out[2])
+{
+    const struct vparse_param *param;
+    uint64_t params[2] = { 0, 0 };
+    uint64_t h[2];
+    int i;
+
+    for (param = entry->params; param; param = param->next) {
+        buf->len = 0;
+        buf_putc(buf, 'P');
+        _fp_putstr(buf, param->name);
+        _fp_putstr(buf, param->value);
+        _murmur3_128(buf->s, buf->len, 0, h);
+        _fp_add(params, h);
+    }
+
+    buf->len = 0;
+    buf_putc(buf, 'E');
+    _fp_putstr(buf, entry->group);
+    _fp_putstr(buf, entry->name);
+    if (entry->multivalue) {
+        const struct vparse_list *item;
+        buf_putc(buf, 'M');
+        for (item = entry->v.values; item; item = item->next)
+            _fp_putstr(buf, item->s);
+    }
+    else {
+        buf_putc(buf, 'V');
+        _fp_putstr(buf, entry->v.value);
+    }
+    for (i = 0; i < 2; i++) {
+        _put32(buf, params[i] & 0xffffffff);
+        _put32(buf, params[i] >> 32);
+    }
+
+    _murmur3_128(buf->s, buf->len, 0, out);
+    buf->len = 0;
+}
+
+/* card->fingerprint holds the running sum until this */
+static void _fp_finish(struct buf *buf, struct vparse_card *card)
+{
+    int i;
+
+    buf->len = 0;
+    buf_putc(buf, 'C');
+    _fp_putstr(buf, card->type);
+    for (i = 0; i < 2; i++) {
+        _put32(buf, card->fingerprint[i] & 0xffffffff);
+        _put32(buf, card->fingerprint[i] >> 32);
+    }
+
+    _murmur3_128(buf->s, buf->len, 0, card->fingerprint);
+    buf->len = 0;
+}
+
+static void _fp_card(struct buf *buf, struct vparse_card *card)
+{
+    const struct vparse_entry *entry;
+    struct vparse_card *sub;
+    uint64_t h[2];
+
+    card->fingerprint[0] = card->fingerprint[1] = 0;
+
+    for (entry = card->properties; entry; entry = entry->next) {
+        _fp_entry(buf, entry, h);
+        _fp_add(card->fingerprint, h);
+    }
+
+    for (sub = card->objects; sub; sub = sub->next) {
+        _fp_card(buf, sub);
+        _fp_add(card->fingerprint, sub->fingerprint);
+    }
+
+    _fp_finish(buf, card);
+}
+
+/* NAME INDEX
+ *
+ * An open addressed table from property name to the first entry with
+ * that name, the others are chained through samename in source order.
+ * Groups aren't keyed, a lookup with one filters the chain for its
+ * name.  Parsed trees keep the table in their arena, trees built by
+ * hand own a malloced one. */
+
+struct index_slot {
+    struct vparse_entry *first;
+    struct vparse_entry *last;
+};
+
+struct vparse_index {
+    size_t mask;
+    struct index_slot *slots;
+};
+
+/* FNV-1a, folding case as it goes */
+static size_t _index_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+
+    return h;
+}
+
+/* never full, so there's always an empty slot to stop at */
+static struct index_slot *_index_slot(const struct vparse_index *index, const char *name)
+{
+    size_t i = _index_hash(name) & index->mask;
+
+    while (index->slots[i].first && strcasecmp(index->slots[i].first->name, name))
+        i = (i + 1) & index->mask;
+
+    return &index->slots[i];
+}
+
+/* in the arena if there is one, otherwise malloced */
+static struct vparse_index *_index_build(struct vparse_card *card, struct vparse_arena *arena)
+{
+    struct vparse_index *index;
+    struct vparse_entry *entry;
+    size_t count = 0, size = 8, len;
+
+    for (entry = card->properties; entry; entry = entry->next)
+        count++;
+    while (size < count * 2)
+        size <<= 1;
+
+    len = sizeof(struct vparse_index) + size * sizeof(struct index_slot);
+    if (arena) index = _arena_zalloc(arena, len);
+    else index = calloc(1, len);
+    index->mask = size - 1;
+    index->slots = (struct index_slot *) (index + 1);
+
+    for (entry = card->properties; entry; entry = entry->next) {
+        struct index_slot *slot;
+        entry->samename = NULL;
+        if (!entry->name) continue;
+        slot = _index_slot(index, entry->name);
+        if (slot->last) slot->last->samename = entry;
+        else slot->first = entry;
+        slot->last = entry;
+    }
+
+    return index;
+}
+
+static void _index_cards(struct vparse_card *card, struct vparse_arena *arena)
+{
+    for (; card; card = card->next) {
+        if (!card->index) card->index = _index_build(card, arena);
+        _index_cards(card->objects, arena);
+    }
+}
+
+/* DIFF AND PATCH
+ *
+ * Entries are paired in two passes: first identical entries (equal
+ * entry hashes, see FINGERPRINTS), then what is left of each name by
+ * how similar they are.  Anything still unpaired was added or removed.
+ * Only the card's own properties are compared, not its sub cards. */
+
+struct diff_item {
+    struct vparse_entry *entry;
+    uint64_t h[2];
+    int pair;   /* index on the other side, or -1 */
+};
+
+static struct diff_item *_diff_items(struct buf *buf, const struct vparse_card *card, int *countp)
+{
+    struct vparse_entry *entry;
+    struct diff_item *items;
+    int n = 0;
+
+    for (entry = card->properties; entry; entry = entry->next) n++;
+    items = malloc((n ? n : 1) * sizeof(struct diff_item));
+
+    for (n = 0, entry = card->properties; entry; entry = entry->next, n++) {
+        items[n].entry = entry;
+        items[n].pair = -1;
+        _fp_entry(buf, entry, items[n].h);
+    }
+
+    *countp = n;
+    return items;
+}
+
+static int _diff_same(const struct diff_item *a, const struct diff_item *b)
+{
+    return a->h[0] == b->h[0] && a->h[1] == b->h[1];
+}
+
+/* 0 means nothing in common beyond the name */
+static int _diff_score(const struct vparse_entry *a, const struct vparse_entry *b)
+{
+    const struct vparse_param *pa, *pb;
+    int score = 0;
+
+    if (a->group && b->group && !strcmp(a->group, b->group))
+        score += 4;
+
+    for (pa = a->params; pa; pa = pa->next) {
+        for (pb = b->params; pb; pb = pb->next) {
+            if (!strcmp(pa->name, pb->name) && !strcmpsafe(pa->value, pb->value)) {
+                score++;
+                break;
+            }
+        }
+    }
+
+    if (a->multivalue && b->multivalue) {
+        const struct vparse_list *va, *vb;
+        for (va = a->v.values, vb = b->v.values; va && vb; va = va->next, vb = vb->next)
+            if (*va->s && !strcmp(va->s, vb->s))
+                score += 2;
+    }
+    else if (!a->multivalue && !b->multivalue) {
+        if (!strcmpsafe(a->v.value, b->v.value))
+            score += 8;
+        else if (a->v.value && b->v.value && *a->v.value == *b->v.value)
+            score++;
+    }
+
+    return score;
+}
+
+static int _diff_unpaired(const struct diff_item *items, int n, const char *name)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (items[i].pair < 0 && !strcmp(items[i].entry->name, name))
+            count++;
+
+    return count;
+}
+
+static struct vparse_diff *_diff_add(struct vparse_diff ***tailp, int op,
+                                     const struct vparse_entry *before,
+                                     const struct vparse_entry *after)
+{
+    struct vparse_diff *item = malloc(sizeof(struct vparse_diff));
+
+    item->op = op;
+    item->before = before;
+    item->after = after;
+    item->next = NULL;
+    **tailp = item;
+    *tailp = &item->next;
+
+    return item;
+}
+
+static struct vparse_param *_dup_params(const struct vparse_param *param)
+{
+    struct vparse_param *res = NULL;
+    struct vparse_param **tail = &res;
+
+    for (; param; param = param->next) {
+        struct vparse_param *copy = malloc(sizeof(struct vparse_param));
+        copy->name = strdup(param->name);
+        copy->value = param->value ? strdup(param->value) : NULL;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+    }
+
+    return res;
+}
+
+static struct vparse_entry *_dup_entry(const struct vparse_entry *entry)
+{
+    struct vparse_entry *copy = malloc(sizeof(struct vparse_entry));
+
+    copy->srcpos = entry->srcpos;
+    copy->rawpos = 0;
+    copy->samename = NULL;
+    copy->group = entry->group ? strdup(entry->group) : NULL;
+    copy->name = strdup(entry->name);
+    copy->multivalue = entry->multivalue;
+    if (entry->multivalue) {
+        const struct vparse_list *item;
+        struct vparse_list **tail = &copy->v.values;
+        for (item = entry->v.values; item; item = item->next) {
+            *tail = malloc(sizeof(struct vparse_list));
+            (*tail)->s = strdup(item->s);
+            tail = &(*tail)->next;
+        }
+        *tail = NULL;
+    }
+    else {
+        copy->v.value = entry->v.value ? strdup(entry->v.value) : NULL;
+    }
+    copy->params = _dup_params(entry->params);
+    copy->next = NULL;
+
+    return copy;
+}
+
+static struct vparse_card *_dup_card(const struct vparse_card *card)
+{
+    struct vparse_card *copy = malloc(sizeof(struct vparse_card));
+    const struct vparse_entry *entry;
+    const struct vparse_card *sub;
+    struct vparse_entry **etail = &copy->properties;
+    struct vparse_card **ctail = &copy->objects;
+
+    copy->type = card->type ? strdup(card->type) : NULL;
+    copy->index = NULL;
+    copy->fingerprint[0] = card->fingerprint[0];
+    copy->fingerprint[1] = card->fingerprint[1];
+
+    for (entry = card->properties; entry; entry = entry->next) {
+        *etail = _dup_entry(entry);
+        etail = &(*etail)->next;
+    }
+    *etail = NULL;
+
+    for (sub = card->objects; sub; sub = sub->next) {
+        *ctail = _dup_card(sub);
+        ctail = &(*ctail)->next;
+    }
+    *ctail = NULL;
+
+    copy->next = NULL;
+    return copy;
+}
+
+/* PUBLIC API */
+
+/* index every card which doesn't have one yet, for trees which weren't
+ * parsed with state->index set */
+void vparse_index(struct vparse_state *state)
+{
+    if (!state->card) return;
+    _index_cards(state->card->objects, state->arena.chunk ? &state->arena : NULL);
+}
+
+struct vparse_entry *vparse_card_find(const struct vparse_card *card, const char *group,
+                                      const char *name, const struct vparse_entry *prev)
+{
+    struct vparse_entry *entry;
+
+    if (prev)
+        entry = card->index ? prev->samename : prev->next;
+    else
+        entry = card->index ? _index_slot(card->index, name)->first : card->properties;
+
+    for (; entry; entry = card->index ? entry->samename : entry->next) {
+        if (!card->index && (!entry->name || strcasecmp(entry->name, name)))
+            continue;
+        if (group && (!entry->group || strcasecmp(entry->group, group)))
+            continue;
+        return entry;
+    }
+
+    return NULL;
+}
+
+int vparse_parse(struct vparse_state *state, int only_one)
+{
+    NEW(state->card, vparse_card);
+    state->top = NULL;
+    state->unnested = 0;
+    state->errortail = &state->errors;
+
+    state->p = state->base;
+    if (state->structural)
+        _structural_init(state);
+
+    /* don't parse trailing non-whitespace */
+    return _parse_vcard(state, state->card, only_one);
+}
+
+/* a single jCard or an array of them, in state->base */
+int vparse_parse_jcard(struct vparse_state *state)
+{
+    struct json_node *root = NULL;
+    const struct json_node *item;
+    struct vparse_card **tail;
+    int r;
+
+    NEW(state->card, vparse_card);
+    tail = &state->card->objects;
+
+    state->p = state->base;
+    r = _json_parse_value(state, &root, 0);
+    if (!r) {
+        _json_ws(state);
+        NOTESTART();
+        if (*state->p) r = PE_JSON_SYNTAX;
+    }
+    if (r) goto done;
+
+    state->p = state->base;
+    if (root->type != JSON_ARRAY) {
+        r = PE_JCARD_FORMAT;
+        goto done;
+    }
+
+    /* just the one */
+    item = root->child && root->child->type == JSON_STRING ? root : root->child;
+    for (; item; item = item == root ? NULL : item->next) {
+        struct vparse_card *card;
+        NEW(card, vparse_card);
+        *tail = card;
+        tail = &card->next;
+        NOTESTART();
+        r = _jcard_read_card(state, item, card);
+        if (r) goto done;
+    }
+
+done:
+    _json_free(root);
+    return r;
+}
+
+/* a parse buffer bigger than this isn't worth keeping */
+#define POOL_MAXBUF (1024 * 1024)
+
+void vparse_pool_get(struct vparse_state *state, struct vparse_pool *pool)
+{
+    buf_free(&state->buf);
+    state->buf = pool->buf;
+    memset(&pool->buf, 0, sizeof(struct buf));
+
+    if (pool->chunk && !state->arena.chunk) {
+        pool->chunk->next = NULL;
+        state->arena.chunk = pool->chunk;
+        state->arena.p = (char *) (pool->chunk + 1);
+        state->arena.left = ARENA_CHUNK;
+        pool->chunk = NULL;
+    }
+}
+
+void vparse_pool_put(struct vparse_state *state, struct vparse_pool *pool)
+{
+    struct vparse_chunk **chunkp;
+
+    if (state->buf.alloc <= POOL_MAXBUF && !pool->buf.alloc) {
+        pool->buf = state->buf;
+        pool->buf.len = 0;
+        memset(&state->buf, 0, sizeof(struct buf));
+    }
+
+    /* the tree may be in the chunk we keep */
+    state->card = NULL;
+    state->entry = NULL;
+    state->param = NULL;
+    state->value = NULL;
+
+    if (pool->chunk || !state->arena.chunk)
+        return;
+
+    /* any chunk of the usual size, the big ones are all different */
+    for (chunkp = &state->arena.chunk; *chunkp; chunkp = &(*chunkp)->next) {
+        if ((*chunkp)->size == ARENA_CHUNK) {
+            pool->chunk = *chunkp;
+            *chunkp = pool->chunk->next;
+            break;
+        }
+    }
+}
+
+void vparse_pool_free(struct vparse_pool *pool)
+{
+    buf_free(&pool->buf);
+    free(pool->chunk);
+    memset(pool, 0, sizeof(struct vparse_pool));
+}
+
+void vparse_free(struct vparse_state *state)
+{
+    _free_state(state);
+}
+
+/* one pass over the source, so every later position lookup is a
+ * binary search rather than a rescan from the start */
+static void _build_lines(struct vparse_state *state)
+{
+    struct vparse_lines *lines = &state->lines;
+    int alloc = 0;
+    const char *p;
+
+    lines->built = 1;
+
+    for (p = strchr(state->base, '\n'); p; p = strchr(p + 1, '\n')) {
+        if (lines->count == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            lines->nl = realloc(lines->nl, alloc * sizeof(int));
+        }
+        lines->nl[lines->count++] = p - state->base;
+    }
+}
+
+/* number of newlines before pos */
+static int _lines_before(struct vparse_state *state, int pos)
+{
+    const int *nl;
+    int lo = 0;
+    int hi;
+
+    if (!state->lines.built)
+        _build_lines(state);
+    nl = state->lines.nl;
+    hi = state->lines.count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (nl[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+void vparse_linepos(struct vparse_state *state, int pos, int *line, int *col)
+{
+    int n = _lines_before(state, pos);
+
+    *line = n + 1;
+    *col = n ? pos - state->lines.nl[n-1] - 1 : pos;
+}
+
+void vparse_fillpos(struct vparse_state *state, struct vparse_errorpos *pos)
+{
+    memset(pos, 0, sizeof(struct vparse_errorpos));
+
+    pos->errorpos = state->p - state->base;
+    pos->startpos = state->itemstart - state->base;
+
+    /* the start position counts the character at itemstart itself */
+    if (state->itemstart && state->itemstart < state->p) {
+        if (*state->itemstart == '\n') {
+            pos->startline = _lines_before(state, pos->startpos) + 2;
+            pos->startchar = 0;
+        }
+        else {
+            vparse_linepos(state, pos->startpos, &pos->startline, &pos->startchar);
+            pos->startchar++;
+        }
+    }
+
+    vparse_linepos(state, pos->errorpos, &pos->errorline, &pos->errorchar);
+}
+
+/* appends card, or all the cards within it if it has no type */
+void vparse_write_card(struct buf *buf, const struct vparse_card *card, const char *eol)
+{
+    struct buf line = BUF_INITIALIZER;
+
+    _write_card(buf, &line, card, eol ? eol : "\n");
+
+    buf_free(&line);
+}
+
+void vparse_write_canonical(struct buf *buf, const struct vparse_card *card)
+{
+    const struct vparse_card *sub;
+
+    /* top level cards keep their order, only their contents are sorted */
+    if (card->type) {
+        _canon_card(buf, card);
+        return;
+    }
+    for (sub = card->objects; sub; sub = sub->next)
+        _canon_card(buf, sub);
+}
+
+/* a single jCard for a typed card, otherwise an array of them */
+void vparse_write_jcard(struct buf *buf, const struct vparse_card *card,
+                        const char *const *types)
+{
+    const struct vparse_card *sub;
+
+    if (card->type) {
+        _jcard_card(buf, card, types);
+        return;
+    }
+
+    buf_putc(buf, '[');
+    for (sub = card->objects; sub; sub = sub->next) {
+        if (sub != card->objects) buf_putc(buf, ',');
+        _jcard_card(buf, sub, types);
+    }
+    buf_putc(buf, ']');
+}
+
+void vparse_write_json(struct buf *buf, struct vparse_state *state, int flags)
+{
+    vparse_index(state);
+    _hjson_card(buf, state->card, state, flags);
+}
+
+/* just the one card, as an element of "objects" */
+void vparse_write_json_card(struct buf *buf, const struct vparse_card *card,
+                            struct vparse_state *state, int flags)
+{
+    _hjson_card(buf, card, state, flags);
+}
+
+/* a typed card is stored as the only child of a typeless root, so
+ * every blob thaws to the same shape vparse_parse produces */
+void vparse_freeze(struct buf *buf, const struct vparse_card *card, int flags)
+{
+    struct blob_counts counts = { 0, 0, 0, 0 };
+    struct vparse_card root;
+    struct vparse_card single;
+
+    if (card->type) {
+        single = *card;
+        single.next = NULL;
+        memset(&root, 0, sizeof(struct vparse_card));
+        root.objects = &single;
+        card = &root;
+    }
+
+    _blob_count(card, &counts);
+    _blob_write(buf, card, &counts, flags);
+}
+
+int vparse_thaw(const char *data, size_t len, struct vparse_card **cardp, int *flagsp)
+{
+    int r = _blob_read(data, len, cardp);
+    if (!r && flagsp)
+        *flagsp = _get32(data + 8);
+    return r;
+}
+
+/* the changes which turn a's properties into b's, pairing identical
+ * entries first and then the most similar of each name */
+struct vparse_diff *vparse_diff(const struct vparse_card *a, const struct vparse_card *b)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct vparse_diff *res = NULL;
+    struct vparse_diff **tail = &res;
+    struct diff_item *ia, *ib;
+    int na, nb;
+    int i, j;
+
+    ia = _diff_items(&buf, a, &na);
+    ib = _diff_items(&buf, b, &nb);
+    buf_free(&buf);
+
+    /* unchanged */
+    for (i = 0; i < na; i++) {
+        for (j = 0; j < nb; j++) {
+            if (ib[j].pair < 0 && _diff_same(&ia[i], &ib[j])) {
+                ia[i].pair = j;
+                ib[j].pair = i;
+                break;
+            }
+        }
+    }
+
+    /* changed: the closest entry with the same name, or the only one */
+    for (i = 0; i < na; i++) {
+        const char *name = ia[i].entry->name;
+        int only, best = -1, bestscore = 0;
+
+        if (ia[i].pair >= 0) continue;
+        only = _diff_unpaired(ia, na, name) == 1 && _diff_unpaired(ib, nb, name) == 1;
+
+        for (j = 0; j < nb; j++) {
+            int score;
+            if (ib[j].pair >= 0 || strcmp(ib[j].entry->name, name)) continue;
+            score = _diff_score(ia[i].entry, ib[j].entry);
+            if (score > bestscore || (only && best < 0)) {
+                best = j;
+                bestscore = score;
+            }
+        }
+
+        if (best >= 0) {
+            ia[i].pair = best;
+            ib[best].pair = i;
+        }
+    }
+
+    for (i = 0; i < na; i++)
+        if (ia[i].pair < 0)
+            _diff_add(&tail, VPARSE_DIFF_REMOVE, ia[i].entry, NULL);
+
+    for (j = 0; j < nb; j++) {
+        if (ib[j].pair < 0)
+            _diff_add(&tail, VPARSE_DIFF_ADD, NULL, ib[j].entry);
+        else if (!_diff_same(&ia[ib[j].pair], &ib[j]))
+            _diff_add(&tail, VPARSE_DIFF_CHANGE, ia[ib[j].pair].entry, ib[j].entry);
+    }
+
+    free(ia);
+    free(ib);
+
+    return res;
+}
+
+void vparse_diff_free(struct vparse_diff *diff)
+{
+    struct vparse_diff *next;
+
+    for (; diff; diff = next) {
+        next = diff->next;
+        free(diff);
+    }
+}
+
+/* every removed or changed entry must be found in card, otherwise
+ * nothing is changed and PE_PATCH_CONFLICT is returned */
+int vparse_patch(struct vparse_card *card, const struct vparse_diff *diff)
+{
+    struct buf buf = BUF_INITIALIZER;
+    const struct vparse_diff *item;
+    struct vparse_entry **tail;
+    struct diff_item *items;
+    const struct vparse_diff **ops;
+    int n, i;
+    int r = 0;
+
+    items = _diff_items(&buf, card, &n);
+    ops = calloc(n ? n : 1, sizeof(*ops));
+
+    for (item = diff; item; item = item->next) {
+        struct diff_item want;
+
+        if (item->op == VPARSE_DIFF_ADD) continue;
+
+        _fp_entry(&buf, item->before, want.h);
+        for (i = 0; i < n; i++)
+            if (!ops[i] && _diff_same(&items[i], &want))
+                break;
+        if (i == n) {
+            r = PE_PATCH_CONFLICT;
+            goto done;
+        }
+        ops[i] = item;
+    }
+
+    tail = &card->properties;
+    for (i = 0; i < n; i++) {
+        struct vparse_entry *entry = items[i].entry;
+        entry->next = NULL;
+        if (ops[i]) {
+            if (ops[i]->op == VPARSE_DIFF_REMOVE) {
+                _free_entry(entry);
+                continue;
+            }
+            _free_entry(entry);
+            entry = _dup_entry(ops[i]->after);
+        }
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    for (item = diff; item; item = item->next) {
+        if (item->op != VPARSE_DIFF_ADD) continue;
+        *tail = _dup_entry(item->after);
+        tail = &(*tail)->next;
+    }
+    *tail = NULL;
+
+    /* the old chains point at freed entries */
+    if (card->index) {
+        free(card->index);
+        card->index = _index_build(card, NULL);
+    }
+
+done:
+    free(ops);
+    free(items);
+    buf_free(&buf);
+    return r;
+}
+
+struct vparse_card *vparse_card_dup(const struct vparse_card *card)
+{
+    return _dup_card(card);
+}
+
+/* recomputes the fingerprint of card and every card inside it, for
+ * trees which weren't parsed with state->fingerprint set */
+void vparse_fingerprint(struct vparse_card *card)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    _fp_card(&buf, card);
+
+    buf_free(&buf);
+}
+
+void vparse_hash128(const char *data, size_t len, uint64_t seed, uint64_t out[2])
+{
+    _murmur3_128(data, len, seed, out);
+}
+
+void vparse_buf_free(struct buf *buf)
+{
+    buf_free(buf);
+}
+
+const char *vparse_errstr(int err)
+{
+    switch(err) {
+    case PE_BACKQUOTE_EOF:
+        return "EOF after backslash";
+    case PE_BEGIN_PARAMS:
+        return "Params on BEGIN field";
+    case PE_ENTRY_MULTIGROUP:
+        return "Multiple group levels in property name";
+    case PE_FINISHED_EARLY:
+        return "VCard not completed";
+    case PE_KEY_EOF:
+        return "End of data while parsing parameter key";
+    case PE_KEY_EOL:
+        return "End of line while parsing parameter key";
+    case PE_MISMATCHED_CARD:
+        return "Closed a different card name than opened";
+    case PE_NAME_EOF:
+        return "End of data while parsing entry name";
+    case PE_NAME_EOL:
+        return "End of line while parsing entry name";
+    case PE_PARAMVALUE_EOF:
+        return "End of data while parsing parameter value";
+    case PE_PARAMVALUE_EOL:
+        return "End of line while parsing parameter value";
+    case PE_QSTRING_EOF:
+        return "End of data while parsing quoted value";
+    case PE_QSTRING_EOL:
+        return "End of line while parsing quoted value";
+    case PE_BLOB_FORMAT:
+        return "Corrupt binary data";
+    case PE_BLOB_VERSION:
+        return "Unsupported binary format version";
+    case PE_PATCH_CONFLICT:
+        return "Patch does not apply to this card";
+    case PE_JSON_SYNTAX:
+        return "Invalid JSON";
+    case PE_JCARD_FORMAT:
+        return "Not a valid jCard";
+    }
+    return "Unknown error";
 }
-#endif
@@ -1,7 +1,16 @@
 #ifndef VCARDFAST_H
 #define VCARDFAST_H
 
+/* vparse.h : the parser's interface, both for the XS glue and as the
+ * installed header of libvparse (see "make libvparse").  Nothing in
+ * here depends on perl. */
+
 #include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct buf {
     char *s;
@@ -27,6 +36,11 @@ PE_PARAMVALUE_EOL,
 PE_QSTRING_EOF,
 PE_QSTRING_EOL,
 PE_QSTRING_COMMA,
+PE_BLOB_FORMAT,
+PE_BLOB_VERSION,
+PE_PATCH_CONFLICT,
+PE_JSON_SYNTAX,
+PE_JCARD_FORMAT,
 PE_NUMERR /* last */
 };
 
@@ -35,6 +49,61 @@ struct vparse_list {
     struct vparse_list *next;
 };
 
+struct vparse_errorpos {
+    int startpos;
+    int startline;
+    int startchar;
+    int errorpos;
+    int errorline;
+    int errorchar;
+};
+
+/* one record per region skipped in recover mode */
+struct vparse_error {
+    int code;
+    struct vparse_errorpos pos;
+    int skipstart;
+    int skipend;
+    struct vparse_error *next;
+};
+
+/* offsets of every newline in the source, built on first use */
+struct vparse_lines {
+    int *nl;
+    int count;
+    int built;
+};
+
+/* the parsed tree lives in a few large chunks, in parse order */
+struct vparse_chunk;
+struct vparse_arena {
+    struct vparse_chunk *chunk;
+    char *p;
+    size_t left;
+};
+
+struct vparse_card;
+
+/* if set, cards go to these as they are parsed rather than into
+ * state->card, and each top level card is freed once it is done.
+ * Nested cards begin and end inside their parent; abort_card drops
+ * everything since the last top level begin_card after an error in
+ * recover mode */
+struct vparse_sink {
+    void *rock;
+    void (*begin_card)(void *rock, const char *type);
+    /* the card has its properties, fingerprint and index, but its
+     * objects have been to the sink already */
+    void (*end_card)(void *rock, const struct vparse_card *card);
+    void (*abort_card)(void *rock);
+};
+
+/* values for state->structural, the last two force the fallbacks
+ * so they can be tested on any CPU */
+#define VPARSE_STRUCTURAL_BEST   1
+#define VPARSE_STRUCTURAL_SSE2   2
+#define VPARSE_STRUCTURAL_SCALAR 3
+
 struct vparse_state {
     struct buf buf;
     const char *base;
@@ -43,12 +112,31 @@ struct vparse_state {
     struct vparse_list *multival;
     struct vparse_list *multiparam;
     int barekeys;
+    int recover;
+    int fingerprint;
+    int index;
+    int structural;  /* find runs through a bitmap of the input, built
+                      * a window at a time, see VPARSE_STRUCTURAL_* */
+    struct vparse_sink *sink;
+    struct vparse_error *errors;
+    struct vparse_error **errortail;  /* where _recover appends */
+    struct vparse_lines lines;
+    uint64_t *smap;  /* the current window of the structural index */
+    size_t sstart;
+    size_t slen;
 
     /* current items */
     struct vparse_card *card;
+    struct vparse_card *top;  /* the top level card being parsed */
+    int unnested;  /* recover mode: a card has run off the end, so a
+                    * BEGIN of a top level card's own type inside it
+                    * starts the next card rather than nesting */
     struct vparse_param *param;
     struct vparse_entry *entry;
     struct vparse_list *value;
+
+    /* everything the parsers allocate for the tree */
+    struct vparse_arena arena;
 };
 
 struct vparse_param {
@@ -58,6 +146,9 @@ struct vparse_param {
 };
 
 struct vparse_entry {
+    int srcpos;   /* byte offset of the entry in the source */
+    int rawpos;   /* byte offset of the value in the source if it is
+                   * there verbatim, 0 if it needed decoding */
     char *group;
     char *name;
     int multivalue;
@@ -67,28 +158,99 @@ struct vparse_entry {
     } v;
     struct vparse_param *params;
     struct vparse_entry *next;
+    struct vparse_entry *samename; /* only if the card is indexed */
 };
 
+struct vparse_index;
+
 struct vparse_card {
     char *type;
+    uint64_t fingerprint[2]; /* only set if asked for */
+    struct vparse_index *index;  /* only set if asked for */
     struct vparse_entry *properties;
     struct vparse_card *objects;
     struct vparse_card *next;
 };
 
-struct vparse_errorpos {
-    int startpos;
-    int startline;
-    int startchar;
-    int errorpos;
-    int errorline;
-    int errorchar;
-};
-
 extern int vparse_parse(struct vparse_state *state, int only_one);
+extern int vparse_parse_jcard(struct vparse_state *state);
 extern void vparse_free(struct vparse_state *state);
+
+/* a parse buffer and an arena chunk to reuse between parses.  Get
+ * them into a cleared state before parsing, and put them back before
+ * vparse_free once the tree isn't wanted, which drops it from the
+ * state.  One pool per thread */
+struct vparse_pool {
+    struct buf buf;
+    struct vparse_chunk *chunk;
+};
+
+extern void vparse_pool_get(struct vparse_state *state, struct vparse_pool *pool);
+extern void vparse_pool_put(struct vparse_state *state, struct vparse_pool *pool);
+extern void vparse_pool_free(struct vparse_pool *pool);
 extern void vparse_fillpos(struct vparse_state *state, struct vparse_errorpos *pos);
+extern void vparse_linepos(struct vparse_state *state, int pos, int *line, int *col);
 extern const char *vparse_errstr(int err);
 
+extern void vparse_write_card(struct buf *buf, const struct vparse_card *card, const char *eol);
+extern void vparse_write_canonical(struct buf *buf, const struct vparse_card *card);
+/* types is NULL or a NULL terminated list of property name, jCard
+ * value type pairs, used ahead of the built in defaults */
+extern void vparse_write_jcard(struct buf *buf, const struct vparse_card *card,
+                               const char *const *types);
+
+/* the vcard2hash structure as JSON, for the whole of state->card,
+ * which gets indexed.  Grouping a single card's properties scans the
+ * card unless it was parsed with an index */
+#define VPARSE_JSON_LINES       (1<<0)
+#define VPARSE_JSON_FINGERPRINT (1<<1)
+#define VPARSE_JSON_ERRORS      (1<<2)
+extern void vparse_write_json(struct buf *buf, struct vparse_state *state, int flags);
+extern void vparse_write_json_card(struct buf *buf, const struct vparse_card *card,
+                                   struct vparse_state *state, int flags);
+
+extern void vparse_buf_free(struct buf *buf);
+
+/* flags stored in a frozen tree */
+#define VPARSE_BLOB_UTF8 (1<<0)
+
+extern void vparse_fingerprint(struct vparse_card *card);
+extern void vparse_hash128(const char *data, size_t len, uint64_t seed, uint64_t out[2]);
+
+/* one change between two cards, pointing into both trees */
+enum vparse_diff_op {
+    VPARSE_DIFF_ADD,
+    VPARSE_DIFF_REMOVE,
+    VPARSE_DIFF_CHANGE
+};
+
+struct vparse_diff {
+    int op;
+    const struct vparse_entry *before;  /* NULL for ADD */
+    const struct vparse_entry *after;   /* NULL for REMOVE */
+    struct vparse_diff *next;
+};
+
+/* lookups by name, through the index if the card has one.  Pass NULL
+ * for the first entry, then the previous one for the rest; group may be
+ * NULL for any */
+extern void vparse_index(struct vparse_state *state);
+extern struct vparse_entry *vparse_card_find(const struct vparse_card *card, const char *group,
+                                             const char *name, const struct vparse_entry *prev);
+
+extern struct vparse_diff *vparse_diff(const struct vparse_card *a, const struct vparse_card *b);
+extern void vparse_diff_free(struct vparse_diff *diff);
+/* patches in place, so only on a tree from vparse_card_dup or vparse_thaw,
+ * never one still in a parser arena */
+extern int vparse_patch(struct vparse_card *card, const struct vparse_diff *diff);
+extern struct vparse_card *vparse_card_dup(const struct vparse_card *card);
+
+extern void vparse_freeze(struct buf *buf, const struct vparse_card *card, int flags);
+extern int vparse_thaw(const char *data, size_t len, struct vparse_card **cardp, int *flagsp);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* VCARDFAST_H */
 